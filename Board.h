@@ -43,6 +43,7 @@ extern "C" {
 #define Board_initGeneral           EK_TM4C123_initGeneral
 #define Board_initGPIO              EK_TM4C123_initGPIO
 #define Board_initI2C               EK_TM4C123_initI2C
+#define Board_recoverI2C            EK_TM4C123_recoverI2C
 #define Board_initPWM               EK_TM4C123_initPWM
 #define Board_initSDSPI             EK_TM4C123_initSDSPI
 #define Board_initSPI               EK_TM4C123_initSPI
@@ -57,6 +58,9 @@ extern "C" {
 #define Board_LED1                  EK_TM4C123_LED_GREEN
 #define Board_LED2                  EK_TM4C123_LED_BLUE
 #define Board_LED3                  EK_TM4C123_LED_RED
+#define Board_DATA_READY            EK_TM4C123_DATA_READY
+#define Board_DATA_READY_OFF        EK_TM4C123_DATA_READY_OFF
+#define Board_DATA_READY_ON         EK_TM4C123_DATA_READY_ON
 #define Board_PININ0                EK_TM4C123_PININ0
 #define Board_PININ1                EK_TM4C123_PININ1
 #define Board_PININ2                EK_TM4C123_PININ2
@@ -211,7 +211,10 @@ GPIO_PinConfig gpioPinConfigs[] = {
     GPIOTiva_PD_2 | GPIO_CFG_OUT_STD | GPIO_CFG_OUT_STR_HIGH | GPIO_CFG_OUT_LOW,
 
     /* EK_TM4C123_LED_RED */
-    GPIOTiva_PD_3 | GPIO_CFG_OUT_STD | GPIO_CFG_OUT_STR_HIGH | GPIO_CFG_OUT_LOW
+    GPIOTiva_PD_3 | GPIO_CFG_OUT_STD | GPIO_CFG_OUT_STR_HIGH | GPIO_CFG_OUT_LOW,
+
+    /* EK_TM4C123_DATA_READY, to the SPI master */
+    GPIOTiva_PA_6 | GPIO_CFG_OUT_STD | GPIO_CFG_OUT_STR_HIGH | GPIO_CFG_OUT_LOW
 };
 
 /*
@@ -372,6 +375,77 @@ void EK_TM4C123_initI2C(void)
   I2C_init();
 }
 
+/* Pins of each I2C bus, for the bus clear in EK_TM4C123_recoverI2C */
+typedef struct {
+    uint32_t periph;
+    uint32_t port;
+    uint8_t  scl;
+    uint8_t  sda;
+    uint32_t sclConfig;
+    uint32_t sdaConfig;
+} EK_TM4C123_I2CPins;
+
+static const EK_TM4C123_I2CPins i2cPins[EK_TM4C123_I2CCOUNT] = {
+    {SYSCTL_PERIPH_I2C0, GPIO_PORTB_BASE, GPIO_PIN_2, GPIO_PIN_3, GPIO_PB2_I2C0SCL, GPIO_PB3_I2C0SDA},
+    {SYSCTL_PERIPH_I2C1, GPIO_PORTG_BASE, GPIO_PIN_4, GPIO_PIN_5, GPIO_PG4_I2C1SCL, GPIO_PG5_I2C1SDA},
+    {SYSCTL_PERIPH_I2C2, GPIO_PORTE_BASE, GPIO_PIN_4, GPIO_PIN_5, GPIO_PE4_I2C2SCL, GPIO_PE5_I2C2SDA},
+    {SYSCTL_PERIPH_I2C3, GPIO_PORTG_BASE, GPIO_PIN_0, GPIO_PIN_1, GPIO_PG0_I2C3SCL, GPIO_PG1_I2C3SDA},
+    {SYSCTL_PERIPH_I2C4, GPIO_PORTG_BASE, GPIO_PIN_2, GPIO_PIN_3, GPIO_PG2_I2C4SCL, GPIO_PG3_I2C4SDA},
+    {SYSCTL_PERIPH_I2C5, GPIO_PORTB_BASE, GPIO_PIN_6, GPIO_PIN_7, GPIO_PB6_I2C5SCL, GPIO_PB7_I2C5SDA},
+};
+
+/* Up to 9 clocks are needed to get a slave to finish the byte it is sending */
+#define I2C_CLEAR_CLOCKS    9
+
+/*
+ *  ======== EK_TM4C123_recoverI2C ========
+ *  Free a bus held by a slave.  The pins are taken over as GPIO and SCL is
+ *  clocked (at about 100kHz) until the slave lets go of SDA, then a STOP is
+ *  sent.  The I2C peripheral is reset and the pins handed back to it.  The
+ *  bus must be closed by its driver first.  Returns true if SDA was released.
+ */
+bool EK_TM4C123_recoverI2C(unsigned int index)
+{
+    const EK_TM4C123_I2CPins *pins = &i2cPins[index];
+    uint32_t halfBit = SysCtlClockGet() / 3 / 200000;  /* SysCtlDelay is 3 cycles per loop */
+    bool released;
+    int i;
+
+    /* SDA as an input, SCL as open drain, idle high */
+    GPIOPinTypeGPIOInput(pins->port, pins->sda);
+    GPIOPinTypeGPIOOutputOD(pins->port, pins->scl);
+    GPIOPinWrite(pins->port, pins->scl, pins->scl);
+    SysCtlDelay(halfBit);
+
+    for (i = 0; (i < I2C_CLEAR_CLOCKS) && !GPIOPinRead(pins->port, pins->sda); i++) {
+        GPIOPinWrite(pins->port, pins->scl, 0);
+        SysCtlDelay(halfBit);
+        GPIOPinWrite(pins->port, pins->scl, pins->scl);
+        SysCtlDelay(halfBit);
+    }
+
+    released = (GPIOPinRead(pins->port, pins->sda) != 0);
+
+    /* STOP: SDA low to high while SCL is high */
+    GPIOPinTypeGPIOOutputOD(pins->port, pins->sda);
+    GPIOPinWrite(pins->port, pins->scl, 0);
+    GPIOPinWrite(pins->port, pins->sda, 0);
+    SysCtlDelay(halfBit);
+    GPIOPinWrite(pins->port, pins->scl, pins->scl);
+    SysCtlDelay(halfBit);
+    GPIOPinWrite(pins->port, pins->sda, pins->sda);
+    SysCtlDelay(halfBit);
+
+    /* Reset the peripheral, clearing any state it was stuck in, and give it back the pins */
+    SysCtlPeripheralReset(pins->periph);
+    GPIOPinConfigure(pins->sclConfig);
+    GPIOPinConfigure(pins->sdaConfig);
+    GPIOPinTypeI2CSCL(pins->port, pins->scl);
+    GPIOPinTypeI2C(pins->port, pins->sda);
+
+    return released;
+}
+
 /*
  *  =============================== PWM ===============================
  */
@@ -53,6 +53,10 @@ extern "C" {
 #define EK_TM4C123_LED_OFF (0)
 #define EK_TM4C123_LED_ON  (1)
 
+/* The data ready line to the SPI master is active high. */
+#define EK_TM4C123_DATA_READY_OFF (0)
+#define EK_TM4C123_DATA_READY_ON  (1)
+
 /*!
  *  @def    EK_TM4C123_GPIOName
  *  @brief  Enum of GPIO names on the EK_TM4C123 dev board
@@ -68,6 +72,7 @@ typedef enum EK_TM4C123_GPIOName {
 	EK_TM4C123_LED_GREEN,
 	EK_TM4C123_LED_BLUE,
 	EK_TM4C123_LED_RED,
+	EK_TM4C123_DATA_READY,
 
     EK_TM4C123_GPIOCOUNT
 } EK_TM4C123_GPIOName;
@@ -198,6 +203,19 @@ extern void EK_TM4C123_initGPIO(void);
  */
 extern void EK_TM4C123_initI2C(void);
 
+/*!
+ *  @brief  Clear a stuck I2C bus and reset its peripheral
+ *
+ *  This function clocks SCL until the slave holding SDA low releases it,
+ *  sends a STOP, then resets the I2C peripheral and returns the pins to it.
+ *  The bus must be closed before calling this, and re-opened afterwards.
+ *
+ *  @param  index   Index of the bus in I2C_config
+ *
+ *  @return true if SDA was released
+ */
+extern bool EK_TM4C123_recoverI2C(unsigned int index);
+
 /*!
  *  @brief  Initialize board specific PWM settings
  *
@@ -10,17 +10,24 @@
 
 #include <stdint.h>
 #include <stdbool.h>
+#include <string.h>
+#include <stddef.h>
 #include <strings.h>
 
 /* XDCtools Header files */
 #include <xdc/std.h>
 #include <xdc/cfg/global.h>
 #include <xdc/runtime/System.h>
+#include <xdc/runtime/Memory.h>
+#include <xdc/runtime/Timestamp.h>
 
 /* BIOS Header files */
 #include <ti/sysbios/BIOS.h>
 #include <ti/sysbios/knl/Task.h>
 #include <ti/sysbios/knl/Semaphore.h>
+#include <ti/sysbios/knl/Clock.h>
+#include <ti/sysbios/knl/Event.h>
+#include <ti/sysbios/hal/Hwi.h>
 
 /* TI-RTOS Header files */
 #include <ti/drivers/GPIO.h>
@@ -37,10 +44,27 @@
 
 /* Board Header file */
 #include "Board.h"
+#include "i2cengine.h"
 
 // Uncomment this line to enable debugging a single port in CC Studio, with diagnostic printfs
 //#define DEBUG_INTERRUPT 1
 
+// Uncomment this line to drain the event log to the CCS console from the idle task, instead of
+// sending it to the master over SPI
+//#define EVENT_LOG_CONSOLE 1
+
+// Uncomment this line to run the sensor buses on the interrupt driven I2C engine (i2cengine.c)
+// instead of the TI-RTOS I2CTiva driver
+//#define I2C_ENGINE 1
+
+// Uncomment this line to measure the time from each conversion complete interrupt to the executive
+// reading the conversion out, printed to the CCS console every EXEC_BENCH_SAMPLES samples
+//#define EXEC_BENCHMARK 1
+
+// Uncomment this line to time I2C transfers on bus 0 through both I2CTiva and the I2C engine at
+// power on, with the results printed to the CCS console.  Needs sensor 0 on its own bus.
+//#define I2C_BENCHMARK 1
+
 // -----------------------------------------------------------------------------
 // High level defines
 
@@ -49,8 +73,20 @@
 #define FIRMWARE_REV_1 0
 #define FIRMWARE_REV_2 6
 
+// Number of sensors, one entry each in sensorConfig[]
 #define MAX_SENSORS               6
 
+// I2C peripherals the sensors can be on
+#define SENSOR_BUSES              6
+
+// The sensors are tracked in 32 bit masks (boot progress, relay group targets), but the relay
+// group status in the diagnostics frame and event log has one byte per mask, a bit per sensor, and
+// so has the sensor mask of the compact data frames.  The tag of a delta stream record has a 3 bit
+// sensor field.
+#if MAX_SENSORS > 8
+#error "Unsupported number of sensors"
+#endif
+
 #ifdef DEBUG_INTERRUPT
 #define MAX_SENSOR_TIMEOUT_MS     5000
 #define MAX_FAILED_INIT_WAIT_MS   5000
@@ -63,17 +99,44 @@
 #define MIN_TASK_SLEEP_MS         1
 #define MIN_TEMP_READ_PERIOD_MS   1000
 #define FILTER_COEFF              0.99333
+#define FILTER_SETTLE_SAMPLES     200     // Readings for the filter to follow a step, ~1.3 time constants
+
+// Retry interval for an absent sensor, doubling on each failed probe.  A reconnected sensor is
+// picked up within PROBE_BACKOFF_MAX_MS.
+#define PROBE_BACKOFF_MIN_MS      100
+#define PROBE_BACKOFF_MAX_MS      2000
+
+// True once the Clock tick count 'now' has reached 'deadline', allowing for wrap
+#define TIME_REACHED(now, deadline) ((int32_t)((now) - (deadline)) >= 0)
+
+// Compile time check, for sizes the preprocessor can't see: a negative array size if 'cond' fails
+#define STATIC_CHECK(cond, name)  typedef char name[(cond) ? 1 : -1]
 
 // Signature pattern to determine if it's a real message
 #define SIGNATURE0               (0xA5)
 #define SIGNATURE1               (0x5A)
 
+// Second signature byte for the alternate frame types; a legacy master will discard these
+#define SIGNATURE1_EVENTS        (0x5B)
+#define SIGNATURE1_DIAG          (0x5C)
+#define SIGNATURE1_STREAM        (0x5E)
+#define SIGNATURE1_RESOURCES     (0x5F)
+#define SIGNATURE1_DELTA         (0x60)
+
+// Second signature byte of the sensor data frame until every sensor has either produced its first
+// sample or failed its first init; the data in it is not valid yet
+#define SIGNATURE1_NOT_READY     (0x5D)
+
 // -----------------------------------------------------------------------------
 // HDC1080 - Temperature and humidity sensor
 #define HDC1080_ADDR              0x40
 #define HDC1080_TMP_REG           0x00
 #define HDC1080_HUM_REG           0x01
 
+// Time from power on until the temperature/humidity sensor answers: 15ms for the HDC1080, 80ms
+// worst case for the Si7020
+#define HUMIDITY_POWERUP_MS       80
+
 // HDC1080 configuration register definitions
 // Bit 15: RST (1 = software reset)
 // Bit 13: HEAT (0 = heater disabled)
@@ -93,6 +156,23 @@
 #define HDC1080_MANUFID           0xFE
 #define HDC1080_DEVICEID          0xFF
 
+// -----------------------------------------------------------------------------
+// Si7020 - Temperature and humidity sensor, fitted in place of the HDC1080 at the same address
+#define Si7020_ADDR          0x40
+#define Si7020_HUM_HOLD      0xE5
+#define Si7020_HUM_NO_HOLD   0xF5
+#define Si7020_TMP_HOLD      0xE3
+#define Si7020_TMP_NO_HOLD   0xF3
+#define Si7020_TMP_PREVIOUS  0xF0
+#define Si7020_TMP_FROM_HUM  0xE0  // Temperature measured during the last humidity measurement
+#define Si7020_RESET         0xFE
+#define Si7020_WRITE_USER_1  0xE6
+#define Si7020_WRITE_USER_2  0x51
+#define Si7020_READ_HEATER   0x11
+
+// Humidity plus temperature measurement time, 12 bit RH and 14 bit temperature, worst case
+#define Si7020_MEASURE_MS         25
+
 // -----------------------------------------------------------------------------
 // AD7746 - Capacitance sensor
 #define AD7746_ADDR               0x48
@@ -101,6 +181,7 @@
 
 // Register definitions
 #define AD7746_STATUS_REG         0x00
+#define AD7746_STATUS_RDY         0x04  // 0 once the conversion on the enabled channels has finished
 #define AD7746_CAP_SETUP_REG      0x07
 
 // Voltage setup register definitions (spec pg 16)
@@ -131,6 +212,10 @@
 #define AD7746_EXC_SET_A          0b01001011
 
 #define AD7746_CFG_REG            0x0A
+#define AD7746_CFG_MODE_MASK      0b00000111  // MD2..0 return to idle when a single conversion ends
+#define AD7746_CAPDAC_A_REG       0x0B
+#define AD7746_CAPDAC_B_REG       0x0C
+#define AD7746_CAPDAC_OFF         0x00
 #define AD7746_CAP_OFFSET_H       0x0D
 #define AD7746_CAP_OFFSET_L       0x0E
 #define AD7746_CAP_GAIN_H         0x0F
@@ -138,6 +223,9 @@
 #define AD7746_VOLT_GAIN_H        0x11
 #define AD7746_VOLT_GAIN_L        0x12
 
+// Capacitance data is 24 bit, offset binary: 0x800000 is 0pF, full scale is +-4.096pF
+#define AD7746_ZERO_COUNTS        0x800000
+
 
 /* Temperature conversion time selections (spec page 18) */
 typedef enum {
@@ -181,7 +269,30 @@ typedef enum {
 #define DEFAULT_CAPACITOR_SELECT adcsC2D1
 
 // Flags to indicate whether to only get the differential cap, or get all 3 (for each sensor)
-bool adGetAllCaps[MAX_SENSORS] = { false, false, false, false, false, false };
+bool adGetAllCaps[MAX_SENSORS];
+
+
+/* Shadow of the AD7746 setup registers (cap setup through CAPDAC B) for each sensor.  Only
+ * registers that have changed are written, as one burst from the first changed register to the
+ * last (the address pointer auto-increments, and rewriting an unchanged register in between costs
+ * less than another transaction).  The shadow is periodically read back and compared, to catch a
+ * device that has reset itself, e.g. after a brown-out. */
+#define AD7746_SHADOW_FIRST       AD7746_CAP_SETUP_REG
+#define AD7746_SHADOW_COUNT       (AD7746_CAPDAC_B_REG - AD7746_CAP_SETUP_REG + 1)
+#define AD7746_SHADOW_ALL         ((1 << AD7746_SHADOW_COUNT) - 1)
+#define AD7746_SHADOW_BIT(reg)    (1 << ((reg) - AD7746_SHADOW_FIRST))
+
+// Read back the shadowed registers once every this many capacitance reads
+#define AD7746_SHADOW_CHECK_INTERVAL 100
+
+typedef struct {
+
+  uint8_t reg[AD7746_SHADOW_COUNT];   // Values the device should be holding
+  uint8_t dirty;                      // Bit per register still to be written
+
+} ad7746Shadow_t;
+
+ad7746Shadow_t ad7746Shadow[MAX_SENSORS];
 
 
 // -----------------------------------------------------------------------------
@@ -191,6 +302,7 @@ bool adGetAllCaps[MAX_SENSORS] = { false, false, false, false, false, false };
 #define PCA9536_OUT_PORT_RESET    0x00
 #define PCA9536_OUT_PORT_NEW_ACS  0x05
 #define PCA9536_OUT_PORT_OLD_ACS  0x0A
+#define PCA9536_OUT_PORT_MASK     0x0F  // Only the low 4 bits are I/O, the rest read back as 1
 #define PCA9536_CONFIG_REG        0x03
 #define PCA9536_CONFIG_ALL_OUTPUT 0x00
 
@@ -202,22 +314,181 @@ typedef enum {
 
 } swRelayPositions;
 
+/* Relay switch sequence, run between conversions so acquisition carries on while it switches */
+typedef enum {
+
+  rsIdle      = 0,  // No switch in progress
+  rsDelay     = 1,  // Waiting before driving the relay
+  rsHold      = 2,  // Relay driven, holding the output
+  rsSettle    = 3   // Output released, waiting for the contacts to settle
+
+} relayState;
+
+// The contacts are in motion from the moment the relay is driven until they have settled
+#define RELAY_MOVING(r)           (((r) == rsHold) || ((r) == rsSettle))
+
+#define RELAY_DELAY_MS            500
+#define RELAY_HOLD_MS             100
+#define RELAY_SETTLE_MS           100
+
+/* Status of a group relay switch, commanded across all the sensors by the 110/111X commands */
+typedef enum {
+
+  rgIdle      = 0,  // No switch commanded since power on
+  rgBusy      = 1,  // Switch in progress
+  rgComplete  = 2,  // Every sensor switched and read back correctly
+  rgFailed    = 3,  // Every sensor finished, at least one failed or could not switch
+  rgTimeout   = 4   // RELAY_GROUP_TIMEOUT_MS passed before every sensor finished
+
+} relayGroupStatus;
+
+// Covers the worst case of the sequence above, with each step waiting for the end of a
+// temperature conversion or a slow capacitance conversion
+#define RELAY_GROUP_TIMEOUT_MS    2000
+
+
+// -----------------------------------------------------------------------------
+// TCA9548 - 8 channel I2C multiplexer, so that several sensors (all at the same addresses) can
+// share one bus.  Writing the control register selects the channels connected downstream, one
+// bit each.
+#define TCA9548_ADDR              0x70  // Plus A2..A0, up to 0x77
+#define TCA9548_CHANNELS          8
+#define TCA9548_NONE              0x00
+
+
+// -----------------------------------------------------------------------------
+// Sensor configuration
+//
+// One entry per sensor: the I2C bus it is on, the TCA9548 it sits behind and on which channel
+// (TCA9548_NONE if it is wired straight to the bus), and the GPIO its AD7746 RDY output drives
+// (SENSOR_NO_INTLINE if it has none, in which case the AD7746 status register is polled).  The
+// sensors on a bus must either share one multiplexer, each on a different channel, or be alone on
+// the bus; main() checks this.  The sensor number is the index in this table, and is what the
+// SPI frames and commands use.
+//
+// To run more sensors than buses, e.g. 12 on two channels of a multiplexer on each bus, raise
+// MAX_SENSORS and list them here; the sensor data frame grows by 19 bytes per sensor.
+
+#define SENSOR_NO_INTLINE         0xFF
+
+typedef struct {
+
+  uint8_t          bus;         // Board_I2Cn
+  uint8_t          mux;         // TCA9548 address, or TCA9548_NONE
+  uint8_t          channel;     // TCA9548 channel
+  uint8_t          intline;     // Board_PININn, or SENSOR_NO_INTLINE
+
+} sensorConfig_t;
+
+const sensorConfig_t sensorConfig[MAX_SENSORS] = {
+
+  { Board_I2C0, TCA9548_NONE, 0, Board_PININ0 },  // PA7
+  { Board_I2C1, TCA9548_NONE, 0, Board_PININ1 },  // PF4
+  { Board_I2C2, TCA9548_NONE, 0, Board_PININ2 },  // PD7
+  { Board_I2C3, TCA9548_NONE, 0, Board_PININ3 },  // PE0
+  { Board_I2C4, TCA9548_NONE, 0, Board_PININ4 },  // PB5
+  { Board_I2C5, TCA9548_NONE, 0, Board_PININ5 }   // PC4
+
+};
+
+// Interval between AD7746 status reads for a sensor with no interrupt line
+#define SENSOR_POLL_MS            5
+
+
 
 // -----------------------------------------------------------------------------
-// I2C structures x6 for the 6 sensors
-I2C_Handle      i2c0, i2c1, i2c2, i2c3, i2c4, i2c5;
-I2C_Params      i2cParams0, i2cParams1, i2cParams2, i2cParams3, i2cParams4, i2cParams5;
-I2C_Transaction i2cTransaction0, i2cTransaction1, i2cTransaction2, i2cTransaction3, i2cTransaction4, i2cTransaction5;
+// I2C buses
+
+// Buses allowed to run in fast mode (400kHz).  A bus drops back to 100kHz for good once it sees
+// I2C_FALLBACK_FAILURES failures within I2C_ERROR_WINDOW transfers while its sensors are running,
+// e.g. on a long cable run; the other buses stay fast.
+bool i2cFastMode[SENSOR_BUSES] = { true, true, true, true, true, true };
+
+#define I2C_ERROR_WINDOW          256
+#define I2C_FALLBACK_FAILURES     8
+
+// Longest any one transfer may take, including clock stretching by the Si7020 during a
+// measurement, before the bus is considered stuck and cleared
+#define I2C_TRANSFER_TIMEOUT_MS   50
+
+#define TCA9548_CHANNEL_UNKNOWN   0xFF
+
+// State of each bus, shared by the sensors on it.  Whichever sensor first finds the bus needs
+// opening, clearing or slowing down does it.  Only the acquisition executive touches the buses,
+// so there is no locking.
+typedef struct {
+
+  // Result of the transfer in progress, set by transferDoneI2C along with the bus's executive
+  // event; the driver is used in callback mode so that a transfer can be given up on
+  bool             ok;
+
+  I2C_Handle       handle;
+  bool             open;
+  bool             fast;
+  bool             fallback;         // Error rate exceeded, the bus is to be reopened at 100kHz
+  bool             stuck;            // A transfer timed out, the bus is closed until it is cleared
+
+  // Error rate while fast, see I2C_ERROR_WINDOW
+  uint32_t         errWindowTransfers;
+  uint32_t         errWindowFailures;
+
+  // Multiplexer channel currently selected, or TCA9548_CHANNEL_UNKNOWN
+  uint8_t          channel;
+
+} sensorBus_t;
+
+sensorBus_t sensorBus[SENSOR_BUSES];
 
 // SPI structures to handle the SPI slave communication
 SPI_Handle      slaveSpi;
 SPI_Params      slaveSpiParams;
 SPI_Transaction slaveTransaction1;
 
+// Posted by the SPI completion callback each time a transfer finishes
+Semaphore_Struct slaveSpiDoneStruct;
+
 
 // -----------------------------------------------------------------------------
 // SPI messaging
 
+// The data of one sensor in the sensor data frame
+typedef struct {
+
+  // Bytes 0 and 1 are the humidity
+  uint8_t humidityHigh;
+  uint8_t humidityLow;
+
+  // Bytes 2, 3 and 4 are the differential capacitance, a 24 bit value
+  uint8_t diffCapHigh;
+  uint8_t diffCapMid;
+  uint8_t diffCapLow;
+
+  // Bytes 5, 6 and 7 are the C1 cap single capacitance
+  uint8_t c1High;
+  uint8_t c1Mid;
+  uint8_t c1Low;
+
+  // Bytes 8, 9 and 10 are the C2 cap single capacitance
+  uint8_t c2High;
+  uint8_t c2Mid;
+  uint8_t c2Low;
+
+  // Byte 11, 12 and 13 are the filtered differential capacitance, a 24 bit value
+  uint8_t filtCapHigh;
+  uint8_t filtCapMid;
+  uint8_t filtCapLow;
+
+  // Bytes 14, 15 are the temperature
+  uint8_t tempHigh;
+  uint8_t tempLow;
+
+  // Bytes 16, 17, and 18 are the on-chip temperature from the capacitance sensor
+  uint8_t chiptempHigh;
+  uint8_t chiptempMid;
+  uint8_t chiptempLow;
+
+} __attribute__((packed)) sensorFrame_t;
+
 // Define a structure which represents the data going back down the SPI, contains
 // all the values of capacitance and temperature and humidity.  Packing
 // is used here to prevent any padding that might be inserted by the compiler.
@@ -232,42 +503,7 @@ union spiMessageOut_u {
       uint8_t version1;
       uint8_t version2;
 
-      struct {
-
-        // Bytes 0 and 1 are the temperature
-        uint8_t humidityHigh;
-        uint8_t humidityLow;
-
-        // Bytes 2, 3 and 4 are the differential capacitance, a 24 bit value
-        uint8_t diffCapHigh;
-        uint8_t diffCapMid;
-        uint8_t diffCapLow;
-
-        // Bytes 5, 6 and 7 are the C1 cap single capacitance
-        uint8_t c1High;
-        uint8_t c1Mid;
-        uint8_t c1Low;
-
-        // Bytes 8, 9 and 10 are the C2 cap single capacitance
-        uint8_t c2High;
-        uint8_t c2Mid;
-        uint8_t c2Low;
-
-        // Byte 11, 12 and 13 are the filtered differential capacitance, a 24 bit value
-        uint8_t filtCapHigh;
-        uint8_t filtCapMid;
-        uint8_t filtCapLow;
-
-        // Bytes 14, 15 are the temperature
-        uint8_t tempHigh;
-        uint8_t tempLow;
-
-        // Bytes 16, 17, and 18 are the on-chip temperature from the capacitance sensor
-        uint8_t chiptempHigh;
-        uint8_t chiptempMid;
-        uint8_t chiptempLow;
-
-      } sensor[MAX_SENSORS];
+      sensorFrame_t sensor[MAX_SENSORS];
 
   } msg;
 
@@ -281,6 +517,46 @@ spiMessageOut_t spiMessageOut;
 
 #define SPI_MESSAGE_LENGTH sizeof(spiMessageOut)
 
+// Bytes the frame CRC adds to each transfer when enabled
+#define SPI_CRC_SIZE              2
+
+// Word aligned sensor data frame, selected by the master with the 17X command: an 8 byte header
+// (SIGNATURE0, the data frame SIGNATURE1, the three firmware version bytes, the layout, two zero
+// bytes) then ALIGNED_FRAME_SENSOR_SIZE bytes per sensor, each field in its own big endian
+// 32 bit word apart from the last, which holds two 16 bit values:
+//   0-3    differential capacitance
+//   4-7    filtered differential capacitance
+//   8-11   C1 capacitance
+//   12-15  C2 capacitance
+//   16-19  on-chip temperature
+//   20,21  temperature
+//   22,23  humidity
+// With an aligned layout selected every other frame is padded with zeros to a multiple of 4 bytes,
+// and the CRC, when enabled, goes in a word of its own (CRC high, CRC low, 0, 0).
+#define ALIGNED_FRAME_HEADER      8
+#define ALIGNED_FRAME_SENSOR_SIZE 24
+#define ALIGNED_FRAME_LENGTH      (ALIGNED_FRAME_HEADER + (MAX_SENSORS * ALIGNED_FRAME_SENSOR_SIZE))
+
+// Command acknowledgement block, appended to every outgoing frame (ahead of the CRC) once the
+// master has turned it on with the 18X command:
+//   0      number of acknowledgements that follow, up to ACK_BLOCK_ENTRIES
+//   1      commands dropped since power on (low byte of spiLinkStats.commandsDropped)
+// then ACK_BLOCK_ENTRIES entries of sequence ID, commandStatus and two bytes of data (big endian,
+// the value read by a register read, otherwise 0), the most recent first, zero past the number
+// given.  The block always holds the latest results rather than only the new ones, so one lost or
+// repeated frame loses nothing; the master matches them up by sequence ID.
+#define ACK_BLOCK_ENTRIES         8
+#define ACK_BLOCK_ENTRY_SIZE      4
+#define ACK_BLOCK_SIZE            (2 + (ACK_BLOCK_ENTRIES * ACK_BLOCK_ENTRY_SIZE))
+
+// The longest transfer, the aligned sensor data frame, the acknowledgement block padded to a word
+// and the CRC word
+#define SPI_TRANSFER_MAX          (ALIGNED_FRAME_LENGTH + ((ACK_BLOCK_SIZE + 3) & ~3) + 4)
+
+// The padded legacy frames, with the acknowledgement block and CRC word, have to fit the transfer
+// buffers too
+STATIC_CHECK(SPI_TRANSFER_MAX >= (((SPI_MESSAGE_LENGTH + ACK_BLOCK_SIZE + 3) & ~3) + 4), legacyFrameFits);
+
 union spiMessageIn_u {
   struct {
 
@@ -292,898 +568,3942 @@ union spiMessageIn_u {
 
     /* Subsequent bytes are for settings that are broadcast every messaging cycle */
     uint8_t useFastConversionTime;
+
+    /* CRC of the bytes above, only checked with frame CRCs enabled (16X) */
+    uint8_t crcHigh;
+    uint8_t crcLow;
   };
 
   /* Make the input buffer match the size of the output by mapping an array on top of it */
-  uint8_t buf[sizeof(spiMessageOut)];
+  uint8_t buf[SPI_TRANSFER_MAX];
 
-} __attribute__((packed));
+} __attribute__((packed, aligned(4)));
 
 typedef union spiMessageIn_u spiMessageIn_t;
 
 spiMessageIn_t spiMessageIn;
 
-
-// -----------------------------------------------------------------------------
-// Filtering of capacitance
+// The SPI slave runs in callback mode and is always armed: the completion callback starts the
+// next transfer straight away, so the master can never clock a frame while nothing is set up.
+// Outgoing frames are double buffered, one armed while the slave task composes the next into the
+// other; if the next is not ready in time the armed one goes out again.  Commands are copied out
+// of the receive buffer by the callback and queued for the slave task.
+//
+// Besides the single command in cmd0..cmd3, a message can carry a batch of up to SPI_BATCH_MAX
+// commands: cmd0 is SPI_BATCH_MARKER, cmd1 the number of commands, and from SPI_BATCH_OFFSET
+// SPI_BATCH_ENTRY_SIZE bytes per command, a sequence ID chosen by the master followed by its
+// cmd0..cmd3.  With CRCs enabled a CRC of the entries follows them.  A batch is queued whole or,
+// if the transfer was too short for it, it fails its CRC or the queue has no room for all of it,
+// not at all.  Each command's result goes into the acknowledgement block under its sequence ID;
+// a single command is acknowledged with sequence ID 0.
+#define SPI_BATCH_MARKER          2
+#define SPI_BATCH_OFFSET          8
+#define SPI_BATCH_ENTRY_SIZE      5
+#define SPI_BATCH_MAX             16
+
+uint8_t           spiTxBuf[2][SPI_TRANSFER_MAX] __attribute__((aligned(4)));
+volatile uint8_t  spiTxArmed;
+volatile bool     spiTxNextReady;
+bool              spiTxCrc[2];         // The frame in each transmit buffer carries a CRC
 
 typedef struct {
 
-  /* Keep track of the current capacitance and the previous value */
-  float c;
-  float cprev;
+  uint8_t cmd0;
+  uint8_t cmd1;
+  uint8_t cmd2;
+  uint8_t cmd3;
+  uint8_t seq;
 
-} capFilter_t;
+} spiCommand_t;
 
-capFilter_t filter[MAX_SENSORS];
+// Must be a power of 2, and hold a full batch
+#define SPI_COMMAND_QUEUE         32
 
+// Command results, as acknowledged to the master
+typedef enum {
 
-// -----------------------------------------------------------------------------
-// Switch states
+  csDone                = 0,  // Carried out, or for a relay switch started (see the diagnostics frame)
+  csUnknown             = 1,  // Not a command, or an argument out of range
+  csQueued              = 2,  // Register operation queued, its result follows under the same ID
+  csFailed              = 3,  // Register operation failed on the bus
+  csRefused             = 4   // Register is run by the firmware, or the sensor is not running
 
-// Current switch command; set this flag to trigger the thread to switch its value
-bool switchcmd0 = false;
-bool switchcmd1 = false;
-bool switchcmd2 = false;
-bool switchcmd3 = false;
-bool switchcmd4 = false;
-bool switchcmd5 = false;
+} commandStatus;
 
-// New switch value
-swRelayPositions switchNew0 = swNewACS;
-swRelayPositions switchNew1 = swNewACS;
-swRelayPositions switchNew2 = swNewACS;
-swRelayPositions switchNew3 = swNewACS;
-swRelayPositions switchNew4 = swNewACS;
-swRelayPositions switchNew5 = swNewACS;
-
-// Interrupt flags, one for each sensor
-bool intflag0 = false;
-bool intflag1 = false;
-bool intflag2 = false;
-bool intflag3 = false;
-bool intflag4 = false;
-bool intflag5 = false;
-
-int currentSwitchPosition = PCA9536_OUT_PORT_NEW_ACS;
-// -----------------------------------------------------------------------------
-// Task control structure
+typedef struct {
 
-// Semaphore for locking the message structure
-Semaphore_Struct semStruct;
-Semaphore_Handle semHandle;
+  uint8_t  seq;
+  uint8_t  status;    // commandStatus
+  uint16_t data;
 
+} commandAck_t;
 
-// Task state machine discrete states
-typedef enum {
+// Results of the latest commands, written and read by the slave task only; must be a power of 2
+#define COMMAND_ACKS              ACK_BLOCK_ENTRIES
 
-  tsPOR                 = 0,
-  tsInit                = 1,
-  tsInitFailed          = 2,
-  tsInitFailedWait      = 3,
-  tsStart               = 4,
-  tsRunning             = 5,
-  tsRunFailed           = 6,
-  tsRunFailedWait       = 7
+commandAck_t commandAck[COMMAND_ACKS];
+uint32_t     commandAckCount;
+bool         spiAckBlock;
 
-} taskState;
+spiCommand_t      spiCommandQueue[SPI_COMMAND_QUEUE];
+volatile uint32_t spiCommandHead;
+volatile uint32_t spiCommandTail;
 
-// Task state data
+// The fast conversion setting from the last good message
+volatile bool     spiFastConversion;
+
+// SPI link counters since power on, for finding the fastest reliable poll rate
 typedef struct {
 
-  uint32_t         device;
-  uint32_t         board;
-  uint32_t         intline;
-  bool            *intflag;
-  I2C_Handle       handle;
-  I2C_Params       i2cparams;
-  I2C_Transaction  trans;
-  bool            *switchcmd;
-  swRelayPositions *switchnew;
-  adCapSelect      cap;
-  adCapSelect      cap_prev;
+  uint32_t transfers;
+  uint32_t repeats;          // The next frame was not composed in time, the last one went again
+  uint32_t failed;           // Transfer did not complete, its message was ignored
+  uint32_t commandsDropped;  // Command queue full
+  uint32_t crcErrors;        // Incoming message failed its CRC, it was ignored
 
-  // State machine
-  taskState        state;
-  uint32_t         wait;
+} spiLinkStats_t;
 
-  // Time since last AD7746 interrupt
-  uint32_t         inttime;
+volatile spiLinkStats_t spiLinkStats;
 
-  // Count the number of AD7746 capacitance reads
-  uint32_t         capreads;
+/* Outgoing frame types, selected by the master with the 14X command */
+typedef enum {
 
-  // Time since last HDC1080 read
-  bool             hdc1080initialized;
-  uint32_t         temptime;
+  ftSensorData          = 0,
+  ftEventLog            = 1,
+  ftDiagnostics         = 2,
+  ftSampleStream        = 3,
+  ftResources           = 4,
+  ftDeltaStream         = 5
+
+} frameType;
+
+frameType spiFrameType = ftSensorData;
+
+// The sensor data frame can be cut down to a profile and a subset of the sensors, selected by the
+// master with the 15PM command, so that more of them fit in a second at the same SPI clock.  The
+// full profile on all sensors is the legacy frame; anything else is a compact frame with a 4 byte
+// header (SIGNATURE0, the data frame SIGNATURE1, profile, sensor mask) followed by the profile's
+// record for each sensor in the mask, lowest sensor first, multi-byte values big endian:
+//   fpFull        the 19 byte sensorFrame_t
+//   fpDiffOnly    0-2 diffCap, 3-5 filtCap
+//   fpDiagnostic  0-2 diffCap, 3 taskState, 4 status flags (DIAG_STATUS_*), 5,6 ms since the
+//                 last good sample (as in the diagnostics frame)
+// The length of the transfer follows the frame, but never drops below COMPACT_FRAME_MIN so the
+// command and settings bytes of the incoming message still arrive.  The master has to clock one
+// more frame of the old length after changing it: the frame after the command is already armed.
+typedef enum {
 
-} taskParams;
+  fpFull                = 0,
+  fpDiffOnly            = 1,
+  fpDiagnostic          = 2
 
+} frameProfile;
 
-/* Function prototypes */
-void taskI2Ccommon(taskParams p);
-void taskI2C0(UArg arg0, UArg arg1);
-void taskI2C1(UArg arg0, UArg arg1);
-void taskI2C2(UArg arg0, UArg arg1);
-void taskI2C3(UArg arg0, UArg arg1);
-void taskI2C4(UArg arg0, UArg arg1);
-void taskI2C5(UArg arg0, UArg arg1);
+#define SENSOR_MASK_ALL           ((1 << MAX_SENSORS) - 1)
 
-void ledActivities(int LED);
-void slaveTaskFxn (UArg arg0, UArg arg1);
-void slaveTaskCommand(void);
+#define COMPACT_FRAME_HEADER      4
+#define COMPACT_FRAME_MIN         5   // cmd0..cmd3, useFastConversionTime
 
-int setupAD7746(I2C_Handle i2c, I2C_Transaction i2cTransaction, uint8_t device);
-int triggerAD7746capacitance(I2C_Handle i2c, I2C_Transaction i2cTransaction, adConversionTime ctim, adCapSelect cap, uint8_t device);
-int triggerAD7746temperature(I2C_Handle i2c, I2C_Transaction i2cTransaction, uint8_t device);
-int readAD7746(I2C_Handle i2c, I2C_Transaction i2cTransaction, adCapSelect cap, uint8_t device);
+frameProfile spiFrameProfile = fpFull;
+uint8_t      spiSensorMask   = SENSOR_MASK_ALL;
 
-int setupHDC1080(I2C_Handle i2c, I2C_Transaction i2cTransaction, uint8_t device, bool reportfail);
-int readHDC1080(I2C_Handle i2c, I2C_Transaction i2cTransaction, uint8_t device);
-int readSi7020(I2C_Handle i2c, I2C_Transaction i2cTransaction, uint8_t device);
+// Length of the frame in each transmit buffer, in SPI data frames
+uint32_t     spiTxCount[2];
 
-int setupPCA9536(I2C_Handle i2c, I2C_Transaction i2cTransaction, uint8_t device);
-int switchPCA9536(I2C_Handle i2c, I2C_Transaction i2cTransaction, uint8_t device, swRelayPositions pos);
+// Layout of the outgoing frames, selected by the master with the 17X command.  The aligned layouts
+// replace the sensor data frame with the aligned one and pad every frame to a multiple of 4 bytes;
+// flAligned16 also runs SSI0 with 16 bit data frames, halving the DMA items and FIFO service per
+// transfer.  The bytes on the wire are the same either way: each pair is swapped in the buffers,
+// as the SSI sends the high byte of a 16 bit frame first and the CPU stores it second.  Going to
+// or from flAligned16 re-opens the SPI slave, dropping the transfer that was armed; the master has
+// to leave at least 5ms after the transfer carrying the command before the next one.
+typedef enum {
 
+  flLegacy              = 0,
+  flAligned             = 1,
+  flAligned16           = 2
 
-/*
- * Show activity on a LED gave as parameter
- *
- * Toggle 4 times the LED in order to see it on the board
- */
-void ledActivities(int LED) {
+} frameLayout;
 
-  GPIO_toggle(LED);
-  Task_sleep(200);
-  GPIO_toggle(LED);
-  Task_sleep(200);
-  GPIO_toggle(LED);
-  Task_sleep(200);
-  GPIO_toggle(LED);
-}
+frameLayout  spiFrameLayout = flLegacy;
 
+// The SPI slave is open with 16 bit data frames, and is being re-opened (slaveSpiDone stays out of
+// the way)
+bool          spiWide;
+volatile bool spiReopen;
 
-/* *  ======== slaveTaskFxn ========
- *  Task function for slave task.
- *
- *  This task runs on a higher priority, since slave
- *  has to be ready for master. Slave SPI sends a
- *  message to master and also receives message from
- *  master. Task for this function is created
- *  statically. See the project's .cfg file.
- */
-void slaveTaskFxn (UArg arg0, UArg arg1) {
 
-  slaveTransaction1.count = SPI_MESSAGE_LENGTH;
+// -----------------------------------------------------------------------------
+// Sensor samples
+//
+// The latest readings of each sensor are kept as native values: raw converter counts, with the
+// Clock ticks (ms) at which they were read.  They are only put into the big endian wire layout of
+// a frame when the frame is composed.
+
+// Sample flag bits
+#define SAMPLE_DIFF_VALID         0x01  // diffCap and filtCap hold a conversion
+#define SAMPLE_C1_VALID           0x02  // c1 holds a conversion
+#define SAMPLE_C2_VALID           0x04  // c2 holds a conversion
+#define SAMPLE_HUM_VALID          0x08  // temp and humidity hold a reading
 
-  /* Wait 5 seconds to allow time to initialize the I2C devices */
-  Task_sleep(5000);
+typedef struct {
 
-  /* Initialize SPI handle with slave mode */
-  SPI_Params_init(&slaveSpiParams);
-  slaveSpiParams.mode        = SPI_SLAVE;
-  //slaveSpiParams.transferMode = SPI_MODE_BLOCKING;
-  slaveSpiParams.frameFormat = SPI_POL1_PHA1;
+  // AD7746 conversions, 24 bit counts
+  uint32_t         diffCap;
+  uint32_t         filtCap;     // diffCap through the FILTER_COEFF low pass filter
+  uint32_t         c1;
+  uint32_t         c2;
+  uint32_t         chipTemp;    // On-chip temperature, read along with every conversion
+  uint32_t         capTime;
 
-  slaveSpi = SPI_open(Board_SPI0, &slaveSpiParams);
-  if (slaveSpi == NULL) {
-    System_abort("slave: Error initializing SPI\n");
-  }
+  // Temperature/humidity sensor readings, 16 bit counts
+  uint16_t         temp;
+  uint16_t         humidity;
+  uint32_t         humTime;
 
-  slaveTransaction1.txBuf = spiMessageOut.buf;
-  slaveTransaction1.rxBuf = spiMessageIn.buf;
+  uint32_t         flags;
 
-  while (1) {
+} sensorSample_t;
 
-    /* Initiate SPI transfer, this could wait forever if the master isn't talking */
-    SPI_transfer(slaveSpi, &slaveTransaction1);
+#define SAMPLE_WORDS              (sizeof(sensorSample_t) / sizeof(uint32_t))
 
-    /* If the first byte of the rx buffer is not a 0, it is a command */
-    if (spiMessageIn.cmd0 != 0) {
+// Samples are published a word at a time
+STATIC_CHECK((sizeof(sensorSample_t) % sizeof(uint32_t)) == 0, sampleWholeWords);
 
-      /* Get access to resource */
-      Semaphore_pend(semHandle, BIOS_WAIT_FOREVER);
+// The executive updates sensorSample[] and publishes it to sensorPub[] under a sequence lock: the
+// sequence is odd while the slot is being written, and moves on every time it is.  The writer
+// never waits.  The SPI slave task puts a sensor into the sensor data frame only when its sequence
+// has moved on since the last frame, and reads just that slot again if it changed under the read.
 
-      /* Process the task commands */
-      slaveTaskCommand();
+typedef struct {
 
-      /* Invalidate the command after processing */
-      spiMessageIn.cmd0 = 0;
+  volatile uint32_t seq;
+  volatile uint32_t data[SAMPLE_WORDS];
 
-      /* Unlock resource */
-      Semaphore_post(semHandle);
+} sensorPub_t;
 
-    }
+sensorSample_t sensorSample[MAX_SENSORS];
+sensorPub_t    sensorPub[MAX_SENSORS];
 
-    /* Each message from the BBB will indicate if fast or slow conversion is being used */
-    if ((bool) spiMessageIn.useFastConversionTime) {
+// The slave task's copy of the last sample read from each sensorPub[] slot, for the compact frames
+sensorSample_t sensorLatest[MAX_SENSORS];
 
-        /* Use fast conversion time (38.0ms i.e 26.3Hz) */
-        adAllSensorConversionTime = FAST_CONVERSION_TIME; // adct38msSingle
 
-    } else {
+// -----------------------------------------------------------------------------
+// Event log
+//
+// Errors and state changes are recorded as small binary records in a ring buffer
+// rather than formatted with System_printf, so the acquisition path never spends
+// time formatting text.  The ring is drained either by the idle task (to the CCS
+// console, with EVENT_LOG_CONSOLE) or over SPI in the event log frame, and the
+// master does the decoding and formatting.  The IDs are part of the wire format,
+// only ever add to the end of this list.
 
-        /* Use slow conversion time (109ms i.e 9Hz) */
-        adAllSensorConversionTime = DEFAULT_CONVERSION_TIME; // adct109msSingle
-    }
+typedef enum {
 
-  }
+  evNone                = 0,
+  evSensorPOR           = 1,  // I2C opened for the sensor
+  evInitOK              = 2,
+  evInitFailPCA9536     = 3,
+  evInitFailAD7746      = 4,
+  evInitFailHDC1080     = 5,  // Non fatal
+  evConvTimeout         = 6,  // arg0: timeout in ms
+  evReadFailAD7746      = 7,
+  evTriggerFailCap      = 8,
+  evTriggerFailTemp     = 9,
+  evHDC1080Reconnected  = 10,
+  evHDC1080Disconnected = 11,
+  evI2CFailAD7746       = 12, // arg0: register, arg1: 1 setup, 2 cap trigger, 3 temp trigger, 4 readout, 5 readback, 6 status poll, 7 register passthrough
+  evI2CFailHDC1080      = 13, // arg0: register, arg1: 1 setup, 2 readout
+  evI2CFailSi7020       = 14, // arg0: command
+  evI2CFailPCA9536      = 15, // arg0: register, arg1: value written
+  evAD7746Calibration   = 16, // arg0: cap offset, arg1: cap gain
+  evRelaySwitched       = 17, // arg0: new position (swRelayPositions)
+  evBadCommand          = 18, // arg0: cmd0 << 8 | cmd1, arg1: cmd2 << 8 | cmd3
+  evRelayGroupDone      = 19, // arg0: sequence ID, arg1: relayGroupStatus, arg2: done << 8 | failed
+  evRelayVerifyFail     = 20, // arg0: expected output port, arg1: read back
+  evAD7746ShadowMismatch = 21, // arg0: register, arg1: expected, arg2: read back
+  evI2CSpeedFallback    = 22, // arg0: failures, arg1: transfers in the error window
+  evI2CTimeout          = 23, // arg0: slave address
+  evI2CBusCleared       = 24, // arg0: 1 if SDA was released, arg1: ms taken
+  evRecoveryTier        = 25, // arg0: recoveryTier, arg1: ms since the first fault
+  evRecovered           = 26, // arg0: highest recoveryTier used, arg1: ms since the first fault
+  evBootReady           = 27, // arg0: ms from power on to ready, arg1: to the first sample
+  evPCA9536VerifyFail   = 28, // arg0: register, arg1: expected, arg2: read back
+  evRegisterOpFail      = 29  // arg0: regChip << 8 | register, arg1: write << 8 | value
+
+} eventId;
+
+#define EVENT_NO_DEVICE           0xFF
 
-}
+typedef struct {
 
+  uint32_t time;      // Clock ticks (ms) when the event was logged
+  uint8_t  id;        // eventId
+  uint8_t  device;    // Sensor number, or EVENT_NO_DEVICE
+  uint16_t arg[3];    // Event specific arguments
 
-/*
- * List of command, first byte should be 1
- * - 110 use all old switch
- * - 111X use particular switch (0 = all new [for legacy compatibility], else bit position indicates on/off values)
- * - 12X retrieve differential capacitance only
- * - 13X retrieve diff plus both single capacitances
- */
-void slaveTaskCommand(void) {
+} eventRecord_t;
 
-  bool switchToNew, switchAllToOld, switchAllToNew, getDiffOnly, getAllCaps;
-  uint8_t diffDevice;
+// Must be a power of 2
+#define EVENT_LOG_SIZE            32
 
-  switchAllToOld  = (spiMessageIn.cmd0 == 1) && (spiMessageIn.cmd1 == 1) && (spiMessageIn.cmd2 == 0);
-  switchToNew     = (spiMessageIn.cmd0 == 1) && (spiMessageIn.cmd1 == 1) && (spiMessageIn.cmd2 == 1);
-  getDiffOnly     = (spiMessageIn.cmd0 == 1) && (spiMessageIn.cmd1 == 2);
-  getAllCaps      = (spiMessageIn.cmd0 == 1) && (spiMessageIn.cmd1 == 3);
+eventRecord_t     eventLog[EVENT_LOG_SIZE];
+volatile uint32_t eventLogHead    = 0;
+volatile uint32_t eventLogTail    = 0;
+volatile uint32_t eventLogDropped = 0;
 
-  // When setting differential vs diff+C1+C2, the device number is in cmd2
-  diffDevice = spiMessageIn.cmd2;
-  if (diffDevice > MAX_SENSORS)
-    diffDevice = 0;
+// Event log frame: the standard 5 byte header, a record count, the number of records dropped
+// since the last frame, then up to EVENT_FRAME_RECORDS records of 12 bytes each (time, id,
+// device, args) with multi-byte values big endian.
+#define EVENT_FRAME_HEADER        7
+#define EVENT_FRAME_RECORD_SIZE   12
+#define EVENT_FRAME_RECORDS       ((SPI_MESSAGE_LENGTH - EVENT_FRAME_HEADER) / EVENT_FRAME_RECORD_SIZE)
 
-  /* Process the commands */
-  if (switchToNew) {
+uint8_t spiEventFrame[SPI_MESSAGE_LENGTH];
 
-    // Set the flags to indicate all the values are getting updated
-    switchcmd0 = true;
-    switchcmd1 = true;
-    switchcmd2 = true;
-    switchcmd3 = true;
-    switchcmd4 = true;
-    switchcmd5 = true;
 
-    // By convention, 0x00 and 0xFF both equal "set all to new ACS"
-    switchAllToNew = (spiMessageIn.cmd3 == 0);
+// -----------------------------------------------------------------------------
+// Sample stream
+//
+// Every capacitance conversion is kept, raw, in a ring buffer per sensor, so that the master can
+// collect all of them rather than only the latest one in the sensor data frame.  When a ring is
+// full the oldest sample is overwritten and counted as dropped.
 
-    // New switch value,
-    switchNew0 = (switchAllToNew || (spiMessageIn.cmd3 & 0b00000001)) ? swNewACS : swOldACS;
-    switchNew1 = (switchAllToNew || (spiMessageIn.cmd3 & 0b00000010)) ? swNewACS : swOldACS;
-    switchNew2 = (switchAllToNew || (spiMessageIn.cmd3 & 0b00000100)) ? swNewACS : swOldACS;
-    switchNew3 = (switchAllToNew || (spiMessageIn.cmd3 & 0b00001000)) ? swNewACS : swOldACS;
-    switchNew4 = (switchAllToNew || (spiMessageIn.cmd3 & 0b00010000)) ? swNewACS : swOldACS;
-    switchNew5 = (switchAllToNew || (spiMessageIn.cmd3 & 0b00100000)) ? swNewACS : swOldACS;
+typedef struct {
 
-  } else if (switchAllToOld) {
+  uint32_t time;      // Clock ticks (ms) when the conversion was read out
+  uint32_t cap;       // adCapSelect in the top byte, the raw 24 bit conversion below it
 
-    // Set the flags to indicate all the values are getting updated
-    switchcmd0 = true;
-    switchcmd1 = true;
-    switchcmd2 = true;
-    switchcmd3 = true;
-    switchcmd4 = true;
-    switchcmd5 = true;
-
-    switchNew0 = swOldACS;
-    switchNew1 = swOldACS;
-    switchNew2 = swOldACS;
-    switchNew3 = swOldACS;
-    switchNew4 = swOldACS;
-    switchNew5 = swOldACS;
+} streamSample_t;
 
-  } else if (getDiffOnly) {
+// Must be a power of 2
+#define SAMPLE_STREAM_DEPTH       64
 
-    adGetAllCaps[diffDevice] = false;
+typedef struct {
 
-  } else if (getAllCaps) {
+  streamSample_t    sample[SAMPLE_STREAM_DEPTH];
+  volatile uint32_t head;
+  volatile uint32_t tail;
+  volatile uint32_t dropped;
+
+} sampleStream_t;
+
+sampleStream_t sampleStream[MAX_SENSORS];
+
+// Sample stream frame: the standard 5 byte header, a record count, the number of samples dropped
+// since the last frame, then up to STREAM_FRAME_RECORDS records of 9 bytes each (device, cap
+// select, time, raw conversion) with multi-byte values big endian.  The sensors are drained in
+// turn, starting one further on each frame.
+#define STREAM_FRAME_HEADER       7
+#define STREAM_FRAME_RECORD_SIZE  9
+#define STREAM_FRAME_RECORDS      ((SPI_MESSAGE_LENGTH - STREAM_FRAME_HEADER) / STREAM_FRAME_RECORD_SIZE)
+
+uint8_t spiStreamFrame[SPI_MESSAGE_LENGTH];
+
+// With either sample stream frame selected, the data ready line is raised once a sensor has this
+// many samples waiting rather than for every conversion
+#define STREAM_READY_THRESHOLD    (SAMPLE_STREAM_DEPTH / 2)
+
+#define STREAM_FRAME_SELECTED()   ((spiFrameType == ftSampleStream) || (spiFrameType == ftDeltaStream))
+
+// Delta stream frame: the same samples as the sample stream frame, but each one coded against the
+// last one sent from the same sensor and capacitor, which rarely differ in more than a few low
+// bits.  The frame is the standard 5 byte header, then:
+//   5      frame sequence number, moves on for every frame composed
+//   6      record count
+//   7      samples dropped since the last frame (saturates)
+//   8,9    bytes of records that follow
+// Each record starts with a tag byte: bit 7 set for a keyframe, bits 6-4 the sensor, bits 1,0 the
+// capacitor (bits 6,5 of the adCapSelect, whose bit 7 is always set).  A keyframe carries the
+// time (4 bytes) and the raw conversion (3 bytes), big endian.  A delta record carries the ms
+// since the last sample of the channel, then the difference in counts zigzag coded (0, -1, 1, -2,
+// ... as 0, 1, 2, 3, ...), both as varints: 7 bits per byte, least significant first, with bit 7
+// set on all but the last byte.
+//
+// A channel goes out as a keyframe when it is first sent after the frame is selected, every
+// DELTA_KEYFRAME_INTERVAL samples after that, and whenever the delta would not be any shorter.  A
+// master that sees a frame sequence number twice has been sent a repeated frame and must skip it;
+// one that sees a gap must drop every channel until its next keyframe.  tools/streamdecode.py is
+// the reference decoder.
+#define DELTA_FRAME_HEADER        10
+#define DELTA_KEYFRAME_SIZE       8
+#define DELTA_KEYFRAME_INTERVAL   16
+#define DELTA_CHANNELS            4
 
-    adGetAllCaps[diffDevice] = true;
+typedef struct {
 
-  } else {
+  bool     synced;     // A keyframe has gone out since the frame was selected
+  uint8_t  sinceKey;   // Delta records since the last keyframe
+  uint32_t time;       // The last sample sent
+  uint32_t counts;
 
-    System_printf("Bad command: %d %d %d %d\n", spiMessageIn.cmd0, spiMessageIn.cmd1, spiMessageIn.cmd2, spiMessageIn.cmd3 );
-    System_flush();
-  }
+} deltaChannel_t;
 
-}
+deltaChannel_t deltaChannel[MAX_SENSORS][DELTA_CHANNELS];
 
+uint8_t spiDeltaFrame[SPI_MESSAGE_LENGTH];
 
-void taskI2Ccommon(taskParams p) {
 
-  /* Infinite loop around the state machine */
-  while (1) {
+// -----------------------------------------------------------------------------
+// Data ready line
+//
+// Board_DATA_READY tells the SPI master there is data it has not been sent yet, so that it can
+// poll when there is something to read instead of on a timer.  It is raised when a sensor
+// publishes a new conversion (or, with the sample stream frame selected, when a stream crosses
+// STREAM_READY_THRESHOLD), and dropped when a transfer finishes unless the frame armed for the
+// next one was composed before the latest data.
 
-    switch(p.state) {
+volatile uint32_t dataReadyCount;      // Moves on for every piece of new data
+uint32_t          spiTxDataCount[2];   // dataReadyCount when each transmit buffer was composed
 
-      // ------------------------------------------------
-      case tsPOR:
 
-#ifdef DEBUG_INTERRUPT
-        // Skip over all but device 0 when debugging
-        if (p.device != 0) break;
-#endif
+// -----------------------------------------------------------------------------
+// Frame CRCs
+//
+// With CRCs enabled by the master (16X), every outgoing frame has a CRC-16/CCITT (polynomial
+// 0x1021, initial value 0xFFFF, big endian) of all its bytes appended, making the transfer 2
+// bytes longer, and the incoming message has to carry one of cmd0..useFastConversionTime in the
+// two bytes after them; a message that fails is counted (spiLinkStats.crcErrors) and ignored.  As
+// with the frame profiles the change reaches the wire one transfer after the command.
+//
+// The CRC has no final XOR, so for frames of one length it is linear: changing some bytes of a
+// frame changes its CRC by the CRC (from 0) of the changed bits, moved on over the bytes that
+// follow them.  Moving a CRC on over a run of zeros is a fixed linear map, kept as a 16 column
+// matrix for each sensor slot of the sensor data frame, so that frame's CRC is kept up to date
+// as slots change rather than computed over the whole frame each time.
 
-        System_printf("(%d) Init device I2C.\n", p.device);
-        System_flush();
+#define CRC16_INIT                0xFFFF
 
-        /* Create I2C for usage */
-        I2C_Params_init(&p.i2cparams);
+volatile bool spiCrcEnabled;
 
-        // Set I2C communication speed
-        p.i2cparams.bitRate = I2C_100kHz;
+// Moves a CRC on over the sensor data frame bytes after each sensor slot
+uint16_t sensorSlotShift[MAX_SENSORS][16];
 
-        // Open the I2C
-        p.handle = I2C_open(p.board, &p.i2cparams);
+// CRC of spiMessageOut.buf
+uint16_t sensorFrameCrc;
 
-        // Check that opening was successful, else kill the system
-        if (p.handle == NULL) {
-          System_abort("(%d) Error initializing I2C.\n");
-        }
 
-        // Pre-load the message header so all messages going out (even if sensors are disconnected)
-        // are still valid.
-        spiMessageOut.msg.signature0 = SIGNATURE0;
-        spiMessageOut.msg.signature1 = SIGNATURE1;
-        spiMessageOut.msg.version0   = FIRMWARE_REV_0;
-        spiMessageOut.msg.version1   = FIRMWARE_REV_1;
-        spiMessageOut.msg.version2   = FIRMWARE_REV_2;
+// -----------------------------------------------------------------------------
+// Filtering of capacitance
 
-        /* Power on reset state; drop into init immediately, don't even need to break */
-        p.state = tsInit;
+typedef struct {
 
+  /* Keep track of the current capacitance and the previous value, in counts from 0pF */
+  float c;
+  float cprev;
 
-      // ------------------------------------------------
-      case tsInit:
-      default:
+} capFilter_t;
 
-        /* Setup ACS connection relay control device */
-        if (setupPCA9536(p.handle, p.trans, p.device) == -1) {
+capFilter_t filter[MAX_SENSORS];
 
-#ifndef DEBUG_INTERRUPT
-          // Suppress these during debugging
-          System_printf("(%d) Error initializing PCA9536 relay controller.\n", p.device);
-          System_flush();
-#endif
 
-          /* Skip to init failed state to wait for next init pass */
-          p.state = tsInitFailed;
-          break;
-        }
+// -----------------------------------------------------------------------------
+// Switch states
 
-        /* Setup the capacitance sensing */
-        if (setupAD7746(p.handle, p.trans, p.device) == -1) {
-          System_printf("(%d) Error initializing AD7746 capacitance sensor.\n", p.device);
-          System_flush();
+// Current switch command for each sensor; set this flag to trigger the thread to switch its value
+bool switchcmd[MAX_SENSORS];
 
-          /* Skip to init failed state to wait for next init pass */
-          p.state = tsInitFailed;
-          break;
-        }
+// New switch value
+swRelayPositions switchNew[MAX_SENSORS];
 
-        /* Setup the temperature/humidity sensing */
-        if (setupHDC1080(p.handle, p.trans, p.device, true) == -1) {
-          p.hdc1080initialized = false;
-          System_printf("(%d) Error initializing HDC1080 temperature/humidity sensor (non fatal).\n", p.device);
-          System_flush();
+// Interrupt flags, one for each sensor; set by the RDY interrupt, or by polling
+bool intflag[MAX_SENSORS];
 
-        } else {
-          p.hdc1080initialized = true;
-        }
+// Current PCA9536 output for each sensor's relay (as last driven), set to the new ACS in main()
+uint8_t relayPosition[MAX_SENSORS];
 
-        p.hdc1080initialized = true;
+// Group relay switch in progress.  Each switch command gets a new sequence ID (never 0); each
+// sensor reports its own result, tagged with the sequence ID it was switching for, and the
+// group status is worked out from those.
+typedef struct {
 
-        /* Got this far, it's now safe to start the device messaging */
-        p.state = tsStart;
+  uint8_t          seq;
+  uint32_t         targets;     // Bit per sensor
+  uint32_t         done;        // Sensors switched and verified
+  uint32_t         failed;      // Sensors that failed or could not switch
+  uint32_t         deadline;
+  relayGroupStatus status;
 
-        System_printf("(%d) Init successful.\n", p.device);
-        System_flush();
+} relayGroup_t;
 
+typedef struct {
 
-        // TODO: Why is this here?   Maybe don't need to wait 100ms before starting.
-        Task_sleep(100);
-        break;
+  uint8_t          seq;
+  bool             ok;
 
+} relayResult_t;
 
-      // ------------------------------------------------
-      case tsInitFailed:
+relayGroup_t  relayGroup;
+relayResult_t relayResult[MAX_SENSORS];
 
-        /* Init failed, probably due to a disconnected sensor */
 
-        /* Setup the wait for a while before re-init attempt */
-        p.wait = MAX_FAILED_INIT_WAIT_MS;
-        p.state = tsInitFailedWait;
-        break;
+// -----------------------------------------------------------------------------
+// Register passthrough
+//
+// The master can read or write any register of the devices on a sensor with the 3SRV command
+// (see slaveTaskCommand), a batch of them at a time.  Each operation is acknowledged csQueued,
+// queued for the sensor and carried out by the executive between two conversions, a few at a
+// time, so acquisition carries on undisturbed; its result is acknowledged again under the same
+// sequence ID, with the value read.
+//
+// AD7746 writes go through the register shadow.  The registers the acquisition sets itself (cap
+// setup, configuration) are refused; writes to the other shadowed ones (VT and excitation setup,
+// CAPDACs) are also kept as the sensor's tuning, which setupAD7746 puts back whenever the AD7746
+// is set up again.  Writes to the PCA9536 output port are refused, the relay commands own it.
 
+typedef enum {
 
-      // ------------------------------------------------
-      case tsInitFailedWait:
+  rcAD7746              = 0,  // 8 bit registers
+  rcPCA9536             = 1,  // 8 bit registers
+  rcHDC1080             = 2,  // 16 bit registers; a write sets the high byte and clears the low
+  rcSi7020              = 3   // 'register' is the command: read E7/11, write E6/51
 
-        /* Running down the timer before we try init again */
-        if (p.wait < MIN_TASK_SLEEP_MS) {
-          p.wait = 0;
-        } else {
-          p.wait = p.wait - MIN_TASK_SLEEP_MS;
-        }
+} regChip;
 
-        if (p.wait == 0) {
-          /* Time to try init again */
-          p.state = tsInit;
-        }
+typedef struct {
 
-        break;
+  uint8_t  seq;
+  uint8_t  chip;      // regChip
+  uint8_t  reg;
+  uint8_t  value;
+  bool     write;
+
+} regOp_t;
 
+typedef struct {
 
-      // ------------------------------------------------
-      case tsStart:
+  uint8_t  seq;
+  uint8_t  status;    // commandStatus
+  uint16_t data;
 
-        /* Perform an initial setup of the device and discard the result; this should
-         * disable any continuous triggering that might cause the interrupts to fire
-         * repeatedly */
-        p.cap = DEFAULT_CAPACITOR_SELECT; // adcsC2D1
-        p.cap_prev = p.cap;
-        triggerAD7746capacitance(p.handle, p.trans, adAllSensorConversionTime, p.cap, p.device);
+} regResult_t;
 
-        /* Clear the interrupt and sleep exceptionally long before re-enabling */
-        GPIO_clearInt(p.intline);
-        Task_sleep(5);
-        GPIO_enableInt(p.intline);
+// Must be powers of 2
+#define REG_OP_QUEUE              8
+#define REG_RESULT_QUEUE          16
 
-        /* Ready for normal running */
-        p.temptime = 0;
-        p.inttime = 0;
-        p.state = tsRunning;
+// Operations carried out in one gap between conversions
+#define REG_OPS_PER_GAP           2
 
-        /* Assert the interrupt flag once to get the sequence rolling (with the side effect of the first read
-         * being bogus) */
-        *p.intflag = 1;
-        break;
+// Queued by the slave task, taken off by the executive
+regOp_t           regOpQueue[MAX_SENSORS][REG_OP_QUEUE];
+volatile uint32_t regOpHead[MAX_SENSORS];
+volatile uint32_t regOpTail[MAX_SENSORS];
 
+// The other way round
+regResult_t       regResultQueue[REG_RESULT_QUEUE];
+volatile uint32_t regResultHead;
+volatile uint32_t regResultTail;
 
-      // ------------------------------------------------
-      case tsRunning:
+// Tuned AD7746 registers, a bit per shadowed register in 'mask'
+typedef struct {
 
-        // SPI has set a flag to switch the node box relay
-        if (*p.switchcmd == true) {
-          *p.switchcmd = false;
+  uint8_t  reg[AD7746_SHADOW_COUNT];
+  uint8_t  mask;
 
-          //TODO: What's with the long delay here?
-          Task_sleep(500);
-          switchPCA9536(p.handle, p.trans, p.device, *p.switchnew);
-          Task_sleep(100);
-        }
+} ad7746Tune_t;
 
-        // If we go for more than 5 seconds without a conversion, something fell off the rails, start over.
-        if (p.inttime > MAX_SENSOR_TIMEOUT_MS) {
-          p.inttime = 0;
+#define AD7746_TUNABLE            (AD7746_SHADOW_BIT(AD7746_VT_SETUP_REG) | AD7746_SHADOW_BIT(AD7746_EXC_SETUP_REG) | \
+                                   AD7746_SHADOW_BIT(AD7746_CAPDAC_A_REG) | AD7746_SHADOW_BIT(AD7746_CAPDAC_B_REG))
 
-          System_printf("(%d) Timeout triggering AD7746 device (%dms), re-initializing.\n", p.device, MAX_SENSOR_TIMEOUT_MS);
-          System_flush();
+ad7746Tune_t ad7746Tune[MAX_SENSORS];
 
-          p.state = tsRunFailed;
-          break;
-        }
+// -----------------------------------------------------------------------------
+// Task control structure
 
-        /* A conversion has completed and interrupted.  Clear it and read out the converted value */
-        if (*p.intflag == 1) {
+// Task state machine discrete states
+typedef enum {
 
-#ifdef DEBUG_INTERRUPT
-System_printf("Thread int flag 0\n"); System_flush();
+  tsPOR                 = 0,
+  tsInit                = 1,
+  tsInitFailed          = 2,
+  tsInitFailedWait      = 3,
+  tsStart               = 4,
+  tsRunning             = 5,
+  tsRunFailed           = 6,
+  tsRunFailedWait       = 7,
+  tsRecover             = 8,
+  tsStartArm            = 9
+
+} taskState;
+
+// Runtime fault recovery, escalating one tier each time a fault recurs before a good sample
+typedef enum {
+
+  rtRetry               = 0,  // Retry the failed transaction (done within transferI2C)
+  rtRetrigger           = 1,  // Start a new conversion
+  rtReconfigure         = 2,  // Set up the AD7746 again, then start a new conversion
+  rtReinit              = 3   // Full re-initialization through tsRunFailed
+
+} recoveryTier;
+#define RECOVERY_TIERS            4
+
+// Times a failed transfer is retried while running
+#define I2C_RETRIES               1
+
+// Events for the acquisition executive: one bit per sensor, posted by its conversion complete
+// interrupt or a relay command for it, and one per bus, posted when a transfer on it completes
+Event_Struct execEvent;
+
+#define EXEC_EVENT_SENSOR(i)      ((uint32_t) 1 << (i))
+#define EXEC_EVENT_SENSORS        (EXEC_EVENT_SENSOR(MAX_SENSORS) - 1)
+#define EXEC_EVENT_BUS(bus)       ((uint32_t) 1 << (MAX_SENSORS + (bus)))
+
+#if (MAX_SENSORS + SENSOR_BUSES) > 32
+#error "Too many sensors and buses for the executive's events"
 #endif
 
-          // As long as interrupts are coming in, don't accumulate time
-          p.inttime = 0;
+// Task state data
+typedef struct {
+
+  uint32_t         device;
+  uint32_t         bus;
+  uint32_t         intline;
+  bool            *intflag;
+  I2C_Handle       handle;
+  I2C_Transaction  trans;
+  bool            *switchcmd;
+  swRelayPositions *switchnew;
+  adCapSelect      cap;
+  adCapSelect      cap_prev;
 
-          // Setup for the next cap while reading the current one
-          p.cap_prev = p.cap;
+  // State machine
+  taskState        state;
 
-          // If only getting differential cap, force it here
-          if (!adGetAllCaps[p.device]) {
-            p.cap = DEFAULT_CAPACITOR_SELECT;
+  // Clock tick at which the executive next runs the state machine, if nothing happens first
+  uint32_t         wakeat;
 
-          } else switch (p.cap) {
+  // Clock tick of the retry timer expiry, see startRetryTimer
+  uint32_t         retryat;
 
-            // Loop around the 3 values infinitely
-            case adcsC2D1:
-            default:
-              p.cap = adcsC1D0;  // Get the C1 single next
-              break;
+  // Current retry interval while the sensor is absent, doubling up to PROBE_BACKOFF_MAX_MS
+  uint32_t         backoff;
 
-            case adcsC1D0:
-              p.cap = adcsC2D0;  // Get the C2 single next
-              break;
+  // Clock tick by which the conversion in progress must have interrupted
+  uint32_t         convdeadline;
 
-            case adcsC2D0:
-              p.cap = adcsC2D1;  // Get the differential next
-              break;
-          }
+  // Count the number of AD7746 capacitance reads
+  uint32_t         capreads;
 
-          // Clear interrupt flag now that we've handled it
-          *p.intflag = 0;
-          GPIO_disableInt(p.intline);
-          Task_sleep(1);
+  // Count of capacitance reads towards the next AD7746 register readback
+  uint32_t         shadowcheck;
 
-          // Read back the converted value from the AD7746, this refers to the previous cap in the sequence
-          if (readAD7746(p.handle, p.trans, p.cap_prev, p.device) == -1) {
-            p.state = tsRunFailed;
-            System_printf("(%d) Timeout reading AD7746 device, re-initializing.\n", p.device);
-            System_flush();
-          }
+  // Fault recovery: the tier reached since the last good sample (rtRetry if none), the lowest
+  // tier the pending fault needs, and the Clock tick of the first fault
+  recoveryTier     tier;
+  recoveryTier     tiermin;
+  uint32_t         faulttime;
 
-#ifdef DEBUG_INTERRUPT
-System_printf("Thread read 0\n"); System_flush();
+  // Clock tick at which the HDC1080 is next due to be read, and whether a measurement has been
+  // started that is to be collected at 'humdue'
+  bool             hdc1080initialized;
+  uint32_t         tempdue;
+  bool             humpending;
+  uint32_t         humdue;
+
+  // Relay switch sequence, with the Clock tick at which the current step is due, the position
+  // being switched to, the group sequence ID and whether every step has verified so far
+  relayState       relay;
+  uint32_t         relaytime;
+  swRelayPositions relaypos;
+  uint8_t          relayseq;
+  bool             relayok;
+
+  // A relay switch step happened while the current conversion was running
+  bool             relayduringconv;
+
+#ifdef EXEC_BENCHMARK
+  // Conversion complete interrupt to readout latency, in Timestamp counts
+  uint32_t         benchcount;
+  uint32_t         benchtotal;
+  uint32_t         benchmax;
+#endif
+
+} taskParams;
+
+// State of every sensor, run by the executive
+taskParams sensorState[MAX_SENSORS];
+
+#ifdef EXEC_BENCHMARK
+// Timestamp of each sensor's last conversion complete interrupt
+volatile uint32_t execRdyTime[MAX_SENSORS];
 #endif
 
-          Task_sleep(1);
 
+// -----------------------------------------------------------------------------
+// Per-sensor health and diagnostics
+//
+// The acquisition executive is the only writer of these entries; the SPI slave task reads them to build
+// the diagnostics frame.  Times are in Clock ticks, which are 1ms in this configuration.
+
+#define DIAG_RATE_WINDOW_MS       1000
+#define DIAG_NEVER                0xFFFF
+
+// Status flag bits
+#define DIAG_STATUS_HDC_OK        0x01  // Temperature/humidity sensor is responding
+#define DIAG_STATUS_RUNNING       0x02  // Sensor is in the normal acquisition state
+#define DIAG_STATUS_RELAY_MOVING  0x04  // A relay switch sequence is in progress
+#define DIAG_STATUS_RELAY_SAMPLE  0x08  // The last sample was taken during a relay switch
+#define DIAG_STATUS_RELAY_NEW     0x10  // The relay was last switched to the new ACS
+#define DIAG_STATUS_I2C_FAST      0x20  // The bus is running at 400kHz
 
-          // --------------------------------------------------------------------------------------
-          // Periodically read the humidity and temperature, but ONLY when the conversion is done.
-          // Do this in order to 'stay off the bus' during a capacitance acquisition.  We will pick up
-          // temperature and humidity after at least 1 second has passed, plus whatever time is left
-          // on the most recent cap conversion.
-          if (p.temptime > MIN_TEMP_READ_PERIOD_MS) {
+typedef struct {
 
-            // Reset the time counter
-            p.temptime = 0;
+  taskState        state;
 
-            /* Setup the temperature/humidity sensing, if a device needs it */
-            if (!p.hdc1080initialized) {
+  // Counters, since power on
+  uint32_t         i2cTransfers;
+  uint32_t         i2cFailures;
+  uint32_t         timeouts;
+  uint32_t         reinits;
+
+  bool             hdcOK;
+
+  // Speed of the bus the sensor is on
+  bool             i2cFast;
+
+  // Fault recoveries at each recoveryTier
+  uint32_t         recoveries[RECOVERY_TIERS];
+
+  // Relay switch state, and whether the last sample overlapped a relay switch
+  bool             relayMoving;
+  bool             relaySample;
+
+  // Time of the last good capacitance sample, valid once at least one has been read
+  bool             sampled;
+  uint32_t         lastSampleTime;
+
+  // Sample rate measurement, samples counted over a window of DIAG_RATE_WINDOW_MS
+  uint32_t         rateWindowStart;
+  uint32_t         rateWindowCount;
+  uint32_t         sampleRate;       // Hz x 100
+
+} sensorDiag_t;
+
+sensorDiag_t sensorDiag[MAX_SENSORS];
+
+// Diagnostics frame: the standard 5 byte header, then DIAG_FRAME_SENSOR_SIZE bytes per sensor,
+// multi-byte values big endian:
+//   0      taskState
+//   1      status flags (DIAG_STATUS_*)
+//   2,3    I2C transfer failures
+//   4,5    conversion timeouts
+//   6,7    re-initializations
+//   8,9    sample rate, Hz x 100
+//   10,11  ms since the last good sample (saturates, DIAG_NEVER if none yet)
+//   12-15  I2C transfers
+// followed by the status of the last group relay switch:
+//   0      sequence ID
+//   1      relayGroupStatus
+//   2      sensors targeted (bit per sensor, the first 8 sensors only)
+//   3      sensors switched and verified
+//   4      sensors failed
+// followed by fault recoveries at each recoveryTier, all sensors together:
+//   0,1    transfers retried
+//   2,3    conversions restarted
+//   4,5    AD7746 reconfigured
+//   6,7    full re-initializations
+// followed by boot timing, DIAG_NEVER until it has happened:
+//   0,1    ms from power on to the first sample from any sensor
+//   2,3    ms from power on to ready (see SIGNATURE1_NOT_READY)
+#define DIAG_FRAME_HEADER         5
+#define DIAG_FRAME_SENSOR_SIZE    16
+#define DIAG_FRAME_RELAY          (DIAG_FRAME_HEADER + (MAX_SENSORS * DIAG_FRAME_SENSOR_SIZE))
+#define DIAG_FRAME_RECOVERY       (DIAG_FRAME_RELAY + 5)
+#define DIAG_FRAME_BOOT           (DIAG_FRAME_RECOVERY + 8)
+
+uint8_t spiDiagFrame[SPI_MESSAGE_LENGTH];
+
+STATIC_CHECK((DIAG_FRAME_BOOT + 4) <= SPI_MESSAGE_LENGTH, diagFrameFits);
+
+// Boot progress: sensors yet to produce a first sample or fail their first init, and the Clock
+// ticks (ms since power on) at which the first sample arrived and the last sensor was done
+uint32_t bootPending = (1 << MAX_SENSORS) - 1;
+bool     bootSampled;
+uint32_t bootFirstSample;
+uint32_t bootReady;
+uint8_t  dataSignature1 = SIGNATURE1_NOT_READY;
+
+// Resources frame: the standard 5 byte header, then the stack of each task in RES_FRAME_TASKS
+// order and the system (Hwi and Swi) stack, 4 bytes each:
+//   0,1    stack size
+//   2,3    most ever used, from the unused stack fill (Task.initStackFlag)
+// followed by the default heap:
+//   0,1    total size
+//   2,3    free
+//   4,5    largest free block
+// all in bytes, followed by the SPI link counters (spiLinkStats_t):
+//   0-3    transfers
+//   4,5    frames repeated
+//   6,7    transfers failed
+//   8,9    commands dropped
+//   10,11  incoming CRC errors
+// multi-byte values big endian.
+#define RES_FRAME_HEADER          5
+#define RES_FRAME_STACK_SIZE      4
+#define RES_FRAME_TASKS           3   // Acquisition executive, SPI slave, idle
+#define RES_FRAME_SYSTEM          (RES_FRAME_HEADER + (RES_FRAME_TASKS * RES_FRAME_STACK_SIZE))
+#define RES_FRAME_HEAP            (RES_FRAME_SYSTEM + RES_FRAME_STACK_SIZE)
+#define RES_FRAME_SPI             (RES_FRAME_HEAP + 6)
+
+uint8_t spiResFrame[SPI_MESSAGE_LENGTH];
 
-              if (setupHDC1080(p.handle, p.trans, p.device, false) == 0) {
-                p.hdc1080initialized = true;
-                System_printf("(%d) HDC1080 temperature/humidity sensor reconnected.\n", p.device);
-                System_flush();
-              }
 
-            } else {
+/* Function prototypes */
+void sensorStep(taskParams *p);
+void relayStep(taskParams *p);
+void relayStart(taskParams *p);
+void relayReport(taskParams *p, bool ok);
+void runFault(taskParams *p, recoveryTier tiermin);
+int restartConversion(taskParams *p);
+void relayGroupStart(uint32_t targets);
+void relayGroupUpdate(void);
+void startRetryTimer(taskParams *p, uint32_t ms);
+bool waitRetryTimer(taskParams *p);
+void humidityFailed(taskParams *p);
+commandStatus queueRegOp(const spiCommand_t *cmd);
+void regOpStep(taskParams *p);
+commandStatus runRegOp(taskParams *p, const regOp_t *op, uint16_t *data);
+void regOpResult(uint8_t seq, commandStatus status, uint16_t data);
+bool readRegResult(regResult_t *res);
+void ackCommand(uint8_t seq, commandStatus status, uint16_t data);
+bool probeSensor(taskParams *p);
+void enableConvInt(taskParams *p);
+void disableConvInt(taskParams *p);
+void sensorExecFxn(UArg arg0, UArg arg1);
+void sensCvtDoneItr(uint32_t index);
+void checkSensorConfig(void);
 
-              // Attempt to read temp/humidity; if it fails, hold the values in reset
-              //if (readHDC1080(p.handle, p.trans, p.device) == -1) {
-              if (readSi7020(p.handle, p.trans, p.device) == -1) {
+void ledActivities(int LED);
+void slaveTaskFxn (UArg arg0, UArg arg1);
+void slaveSpiDone(SPI_Handle handle, SPI_Transaction *transaction);
+void queueCommand(const uint8_t *cmd, uint8_t seq);
+void queueBatch(uint32_t received, bool crc);
+bool readCommand(spiCommand_t *cmd);
+uint32_t putAckBlock(uint8_t *out);
+void openSlaveSpi(bool wide);
+void swapBytePairs(uint8_t *buf, uint32_t length);
+void composeTxBuf(uint8_t index);
+uint32_t composeFrame(uint8_t *out);
+commandStatus slaveTaskCommand(const spiCommand_t *cmd);
+
+void logEvent(eventId id, uint8_t device, uint16_t arg0, uint16_t arg1, uint16_t arg2);
+bool readEvent(eventRecord_t *rec);
+void composeEventFrame(void);
+void eventLogIdleFxn(void);
+
+void publishSensor(uint8_t device);
+bool readSensorSample(uint8_t device, uint32_t *seen, sensorSample_t *sample);
+void putSensorFrame(sensorFrame_t *out, const sensorSample_t *sample);
+void composeSensorFrame(void);
+uint32_t composeCompactFrame(uint8_t *out);
+uint32_t composeAlignedFrame(uint8_t *out);
+
+uint16_t crc16(uint16_t crc, const uint8_t *data, uint32_t length);
+uint16_t crcShift(const uint16_t *matrix, uint16_t crc);
+void crcInit(void);
+
+void streamSample(uint8_t device, adCapSelect cap, uint32_t counts);
+bool readStreamSample(uint8_t device, streamSample_t *rec);
+uint8_t readStreamDropped(void);
+void dataReadyPost(void);
+void composeStreamFrame(void);
+void deltaStreamReset(void);
+uint8_t *putVarint(uint8_t *out, uint32_t value);
+uint32_t varintSize(uint32_t value);
+uint8_t *putDeltaRecord(uint8_t *out, uint8_t device, const streamSample_t *rec);
+void composeDeltaFrame(void);
+
+void diagSample(uint8_t device);
+void bootDone(uint8_t device, bool sampled);
+uint8_t diagStatus(uint8_t device);
+uint16_t diagAge(uint8_t device, uint32_t now);
+void composeDiagFrame(void);
+void composeResFrame(void);
+void putStackUsage(uint8_t *out, uint32_t size, uint32_t used);
+bool transferI2C(I2C_Handle i2c, I2C_Transaction *i2cTransaction, uint8_t device);
+bool transferOnceI2C(I2C_Handle i2c, I2C_Transaction *i2cTransaction, uint8_t device);
+bool selectMuxI2C(uint8_t device);
+bool transferBusI2C(uint8_t bus, I2C_Transaction *i2cTransaction);
+void openI2C(taskParams *p);
+void recoverI2C(taskParams *p);
+void transferDoneI2C(I2C_Handle handle, I2C_Transaction *i2cTransaction, bool ok);
+#ifdef I2C_ENGINE
+void transferDoneEngine(i2cEngineTransaction *trans);
+#endif
+#ifdef I2C_BENCHMARK
+void benchmarkI2C(taskParams *p);
+#endif
+#ifdef EXEC_BENCHMARK
+void benchmarkExec(taskParams *p);
+#endif
 
-                p.hdc1080initialized = false;
-                System_printf("(%d) HDC1080 temperature/humidity sensor DISCONNECTED!\n", p.device);
-                System_flush();
+int setupAD7746(I2C_Handle i2c, I2C_Transaction i2cTransaction, uint8_t device);
+int triggerAD7746capacitance(I2C_Handle i2c, I2C_Transaction i2cTransaction, adConversionTime ctim, adCapSelect cap, uint8_t device);
+int triggerAD7746temperature(I2C_Handle i2c, I2C_Transaction i2cTransaction, uint8_t device);
+int readAD7746(I2C_Handle i2c, I2C_Transaction i2cTransaction, adCapSelect cap, uint8_t device);
+uint32_t filterCap(capFilter_t *f, uint32_t counts);
+void setAD7746register(uint8_t device, uint8_t reg, uint8_t value);
+int writeAD7746registers(I2C_Handle i2c, I2C_Transaction i2cTransaction, uint8_t device, uint8_t op);
+int checkAD7746registers(I2C_Handle i2c, I2C_Transaction i2cTransaction, uint8_t device);
+int pollAD7746(I2C_Handle i2c, I2C_Transaction i2cTransaction, uint8_t device);
 
-                /* Get access to resource */
-                Semaphore_pend(semHandle, BIOS_WAIT_FOREVER);
+int setupHDC1080(I2C_Handle i2c, I2C_Transaction i2cTransaction, uint8_t device, bool reportfail);
+int readHDC1080(I2C_Handle i2c, I2C_Transaction i2cTransaction, uint8_t device);
+int startSi7020(I2C_Handle i2c, I2C_Transaction i2cTransaction, uint8_t device);
+int readSi7020(I2C_Handle i2c, I2C_Transaction i2cTransaction, uint8_t device);
 
-                spiMessageOut.msg.sensor[p.device].tempHigh     = 0;
-                spiMessageOut.msg.sensor[p.device].tempLow      = 0;
-                spiMessageOut.msg.sensor[p.device].humidityHigh = 0;
-                spiMessageOut.msg.sensor[p.device].humidityLow  = 0;
+int setupPCA9536(I2C_Handle i2c, I2C_Transaction i2cTransaction, uint8_t device);
+int switchPCA9536(I2C_Handle i2c, I2C_Transaction i2cTransaction, uint8_t device, swRelayPositions pos);
+int releasePCA9536(I2C_Handle i2c, I2C_Transaction i2cTransaction, uint8_t device);
+int verifyPCA9536(I2C_Handle i2c, I2C_Transaction i2cTransaction, uint8_t device, uint8_t expected);
 
-                /* Unlock resource */
-                Semaphore_post(semHandle);
 
-              }
-            }
-          }
-          // End of temperature/humidity conversion code.
-          // --------------------------------------------------------------------------------------
+/*
+ * Show activity on a LED gave as parameter
+ *
+ * Toggle 4 times the LED in order to see it on the board
+ */
+void ledActivities(int LED) {
 
-          // Setup interrupt for next conversion completion
-          GPIO_clearInt(p.intline);
-          GPIO_enableInt(p.intline);
+  GPIO_toggle(LED);
+  Task_sleep(200);
+  GPIO_toggle(LED);
+  Task_sleep(200);
+  GPIO_toggle(LED);
+  Task_sleep(200);
+  GPIO_toggle(LED);
+}
 
-          // Trigger the next conversion
-          if (p.capreads++ == AD7746_CAP_VS_TEMP_TRIGGER_INTERVAL) {
 
-#ifdef DEBUG_INTERRUPT
-System_printf("Trigger temp 0\n"); System_flush();
-#endif
+/*
+ *  ======== logEvent ========
+ *  Record an event in the event log.  Safe to call from tasks and interrupts; it never blocks,
+ *  interrupts are only held off for the copy of one record.  When the log is full the oldest
+ *  record is overwritten and counted as dropped.
+ */
+void logEvent(eventId id, uint8_t device, uint16_t arg0, uint16_t arg1, uint16_t arg2) {
 
-            // Every Nth capacitance reading, trigger a temperature conversion instead
-            if (triggerAD7746temperature(p.handle, p.trans, p.device) == -1) {
-              p.state = tsRunFailed;
-              System_printf("(%d) Timeout triggering AD7746 device (temperature), re-initializing.\n", p.device);
-              System_flush();
+  eventRecord_t *rec;
+  UInt key;
 
-              p.capreads = 0;
-            }
+  key = Hwi_disable();
 
-          } else {
+  if ((eventLogHead - eventLogTail) >= EVENT_LOG_SIZE) {
+    eventLogTail++;
+    eventLogDropped++;
+  }
 
-#ifdef DEBUG_INTERRUPT
-System_printf("Trigger cap 0\n"); System_flush();
-#endif
+  rec = &eventLog[eventLogHead & (EVENT_LOG_SIZE - 1)];
+  rec->time   = Clock_getTicks();
+  rec->id     = id;
+  rec->device = device;
+  rec->arg[0] = arg0;
+  rec->arg[1] = arg1;
+  rec->arg[2] = arg2;
+  eventLogHead++;
 
-            // Normal case is to trigger capacitance reads over and over
-            if (triggerAD7746capacitance(p.handle, p.trans, adAllSensorConversionTime, p.cap, p.device) == -1) {
-              p.state = tsRunFailed;
-              System_printf("(%d) Timeout triggering AD7746 device (caps), re-initializing.\n", p.device);
-              System_flush();
-            }
+  Hwi_restore(key);
+}
 
-          }
 
-          Task_sleep(1);
+/*
+ *  ======== readEvent ========
+ *  Remove the oldest record from the event log.  Returns false if the log is empty.
+ */
+bool readEvent(eventRecord_t *rec) {
 
-          p.inttime += 3;
-          p.temptime += 3;
-        }
+  UInt key;
+  bool found = false;
 
-        break;
+  key = Hwi_disable();
 
+  if (eventLogTail != eventLogHead) {
+    *rec = eventLog[eventLogTail & (EVENT_LOG_SIZE - 1)];
+    eventLogTail++;
+    found = true;
+  }
 
-      // ------------------------------------------------
-      case tsRunFailed:
-
-        /* Runtime failure, probably due to a disconnected sensor */
-
-        /* Hold the cap/temp/hum in reset */
-
-        /* Get access to resource */
-        Semaphore_pend(semHandle, BIOS_WAIT_FOREVER);
-
-        spiMessageOut.msg.signature0                    = SIGNATURE0;
-        spiMessageOut.msg.signature1                    = SIGNATURE1;
-        spiMessageOut.msg.version0                      = FIRMWARE_REV_0;
-        spiMessageOut.msg.version1                      = FIRMWARE_REV_1;
-        spiMessageOut.msg.version2                      = FIRMWARE_REV_2;
-        spiMessageOut.msg.sensor[p.device].diffCapHigh  = 0;
-        spiMessageOut.msg.sensor[p.device].diffCapMid   = 0;
-        spiMessageOut.msg.sensor[p.device].diffCapLow   = 0;
-        spiMessageOut.msg.sensor[p.device].c1High       = 0;
-        spiMessageOut.msg.sensor[p.device].c1Mid        = 0;
-        spiMessageOut.msg.sensor[p.device].c1Low        = 0;
-        spiMessageOut.msg.sensor[p.device].c2High       = 0;
-        spiMessageOut.msg.sensor[p.device].c2Mid        = 0;
-        spiMessageOut.msg.sensor[p.device].c2Low        = 0;
-        spiMessageOut.msg.sensor[p.device].tempHigh     = 0;
-        spiMessageOut.msg.sensor[p.device].tempLow      = 0;
-        spiMessageOut.msg.sensor[p.device].humidityHigh = 0;
-        spiMessageOut.msg.sensor[p.device].humidityLow  = 0;
-        spiMessageOut.msg.sensor[p.device].chiptempHigh = 0;
-        spiMessageOut.msg.sensor[p.device].chiptempMid  = 0;
-        spiMessageOut.msg.sensor[p.device].chiptempLow  = 0;
-
-        /* Unlock resource */
-        Semaphore_post(semHandle);
-
-        /* Setup the wait for a while before re-init attempt */
-        p.wait = MAX_FAILED_INIT_WAIT_MS;
-        p.state = tsRunFailedWait;
-        break;
+  Hwi_restore(key);
 
+  return found;
+}
 
-      // ------------------------------------------------
-      case tsRunFailedWait:
 
-        /* Running down the timer before we try to init again */
-        if (p.wait < MIN_TASK_SLEEP_MS) {
-          p.wait = 0;
-        } else {
-          p.wait = p.wait - MIN_TASK_SLEEP_MS;
-        }
+/*
+ *  ======== composeEventFrame ========
+ *  Drain as many events as fit into the event log frame going out on the next SPI transfer.
+ */
+void composeEventFrame(void) {
+
+  eventRecord_t rec;
+  uint8_t *out;
+  uint32_t dropped;
+  UInt key;
+  uint32_t count = 0;
+
+  bzero(spiEventFrame, sizeof(spiEventFrame));
+
+  spiEventFrame[0] = SIGNATURE0;
+  spiEventFrame[1] = SIGNATURE1_EVENTS;
+  spiEventFrame[2] = FIRMWARE_REV_0;
+  spiEventFrame[3] = FIRMWARE_REV_1;
+  spiEventFrame[4] = FIRMWARE_REV_2;
+
+  out = &spiEventFrame[EVENT_FRAME_HEADER];
+
+  while ((count < EVENT_FRAME_RECORDS) && readEvent(&rec)) {
+
+    out[0]  = (rec.time >> 24) & 0xFF;
+    out[1]  = (rec.time >> 16) & 0xFF;
+    out[2]  = (rec.time >>  8) & 0xFF;
+    out[3]  = (rec.time      ) & 0xFF;
+    out[4]  = rec.id;
+    out[5]  = rec.device;
+    out[6]  = (rec.arg[0] >> 8) & 0xFF;
+    out[7]  = (rec.arg[0]     ) & 0xFF;
+    out[8]  = (rec.arg[1] >> 8) & 0xFF;
+    out[9]  = (rec.arg[1]     ) & 0xFF;
+    out[10] = (rec.arg[2] >> 8) & 0xFF;
+    out[11] = (rec.arg[2]     ) & 0xFF;
+
+    out += EVENT_FRAME_RECORD_SIZE;
+    count++;
+  }
 
-        if (p.wait == 0) {
-          /* Time to try init again */
-          p.state = tsInit;
-        }
+  // Report (and reset) the number of records lost to overflow, saturating at one byte
+  key = Hwi_disable();
+  dropped = eventLogDropped;
+  eventLogDropped = 0;
+  Hwi_restore(key);
 
-        break;
-    }
+  spiEventFrame[5] = count;
+  spiEventFrame[6] = (dropped > 0xFF) ? 0xFF : dropped;
+}
+
+
+/*
+ *  ======== publishSensor ========
+ *  Publish the latest sample of a sensor for the next sensor data frame.  Only called by the
+ *  executive, which the SPI slave task cannot preempt, so it never has to wait.
+ */
+void publishSensor(uint8_t device) {
+
+  sensorPub_t *pub = &sensorPub[device];
+  const uint32_t *src = (const uint32_t *) &sensorSample[device];
+  uint32_t i;
 
-    /* Yield for 1ms before starting state machine again */
-    Task_sleep(MIN_TASK_SLEEP_MS);
-    p.inttime += MIN_TASK_SLEEP_MS;
-    p.temptime += MIN_TASK_SLEEP_MS;
+  pub->seq++;
+
+  for (i = 0; i < SAMPLE_WORDS; i++) {
+    pub->data[i] = src[i];
   }
 
+  pub->seq++;
+}
+
+
+/*
+ *  ======== readSensorSample ========
+ *  Read the published sample of a sensor, if it has been published again since sequence '*seen'.
+ *  Returns false, leaving 'sample' alone, if it has not.
+ */
+bool readSensorSample(uint8_t device, uint32_t *seen, sensorSample_t *sample) {
+
+  sensorPub_t *pub = &sensorPub[device];
+  uint32_t *dst = (uint32_t *) sample;
+  uint32_t seq, i;
+
+  do {
+    seq = pub->seq;
+    if (seq == *seen) {
+      return false;
+    }
+
+    for (i = 0; i < SAMPLE_WORDS; i++) {
+      dst[i] = pub->data[i];
+    }
+  } while ((seq & 1) || (pub->seq != seq));
+
+  *seen = seq;
+  return true;
 }
 
 
+/*
+ *  ======== putSensorFrame ========
+ *  Put a sample into the wire layout of the sensor data frame.
+ */
+void putSensorFrame(sensorFrame_t *out, const sensorSample_t *sample) {
+
+  out->humidityHigh = (sample->humidity >>  8) & 0xFF;
+  out->humidityLow  = (sample->humidity      ) & 0xFF;
+  out->diffCapHigh  = (sample->diffCap  >> 16) & 0xFF;
+  out->diffCapMid   = (sample->diffCap  >>  8) & 0xFF;
+  out->diffCapLow   = (sample->diffCap       ) & 0xFF;
+  out->c1High       = (sample->c1       >> 16) & 0xFF;
+  out->c1Mid        = (sample->c1       >>  8) & 0xFF;
+  out->c1Low        = (sample->c1            ) & 0xFF;
+  out->c2High       = (sample->c2       >> 16) & 0xFF;
+  out->c2Mid        = (sample->c2       >>  8) & 0xFF;
+  out->c2Low        = (sample->c2            ) & 0xFF;
+  out->filtCapHigh  = (sample->filtCap  >> 16) & 0xFF;
+  out->filtCapMid   = (sample->filtCap  >>  8) & 0xFF;
+  out->filtCapLow   = (sample->filtCap       ) & 0xFF;
+  out->tempHigh     = (sample->temp     >>  8) & 0xFF;
+  out->tempLow      = (sample->temp          ) & 0xFF;
+  out->chiptempHigh = (sample->chipTemp >> 16) & 0xFF;
+  out->chiptempMid  = (sample->chipTemp >>  8) & 0xFF;
+  out->chiptempLow  = (sample->chipTemp      ) & 0xFF;
+}
+
 
 /*
- *  ======== taskI2C0 ========
- *  Task for this function is created statically. See the project's .cfg file.
+ *  ======== composeSensorFrame ========
+ *  Bring the sensor data frame going out on the next SPI transfer up to date, putting in each
+ *  sensor published since the last one.
  */
-void taskI2C0(UArg arg0, UArg arg1) {
-  taskParams p;
+void composeSensorFrame(void) {
+
+  static uint32_t seen[MAX_SENSORS];
+  sensorFrame_t *slot;
+  uint8_t diff[sizeof(sensorFrame_t)];
+  uint32_t i;
+  int device;
+
+  // The header only changes when the data first becomes ready; the CRC is then done in full
+  if ((spiMessageOut.msg.signature0 != SIGNATURE0) || (spiMessageOut.msg.signature1 != dataSignature1)) {
+
+    spiMessageOut.msg.signature0 = SIGNATURE0;
+    spiMessageOut.msg.signature1 = dataSignature1;
+    spiMessageOut.msg.version0   = FIRMWARE_REV_0;
+    spiMessageOut.msg.version1   = FIRMWARE_REV_1;
+    spiMessageOut.msg.version2   = FIRMWARE_REV_2;
+
+    sensorFrameCrc = crc16(CRC16_INIT, spiMessageOut.buf, SPI_MESSAGE_LENGTH);
+  }
+
+  for (device = 0; device < MAX_SENSORS; device++) {
+
+    if (!readSensorSample(device, &seen[device], &sensorLatest[device])) {
+      continue;
+    }
+
+    slot = &spiMessageOut.msg.sensor[device];
+
+    memcpy(diff, slot, sizeof(diff));
+    putSensorFrame(slot, &sensorLatest[device]);
+    for (i = 0; i < sizeof(diff); i++) {
+      diff[i] ^= ((uint8_t *) slot)[i];
+    }
+
+    sensorFrameCrc ^= crcShift(sensorSlotShift[device], crc16(0, diff, sizeof(diff)));
+  }
+}
 
-  p.device    = 0;
-  p.board     = Board_I2C0;
-  p.intline   = Board_PININ0;
-  p.intflag   = &intflag0;
-  p.handle    = i2c0;
-  p.i2cparams = i2cParams0;
-  p.trans     = i2cTransaction0;
-  p.switchcmd = &switchcmd0;
-  p.switchnew = &switchNew0;
-  p.inttime   = 0;
-  p.state     = tsPOR;
 
-  taskI2Ccommon(p);
+/*
+ *  ======== composeAlignedFrame ========
+ *  Compose the word aligned sensor data frame from the samples composeSensorFrame last read.
+ *  Returns the length of the frame.
+ */
+uint32_t composeAlignedFrame(uint8_t *out) {
+
+  const sensorSample_t *sample;
+  uint8_t *rec;
+  int device;
+
+  out[0] = SIGNATURE0;
+  out[1] = dataSignature1;
+  out[2] = FIRMWARE_REV_0;
+  out[3] = FIRMWARE_REV_1;
+  out[4] = FIRMWARE_REV_2;
+  out[5] = spiFrameLayout;
+  out[6] = 0;
+  out[7] = 0;
+
+  for (device = 0; device < MAX_SENSORS; device++) {
+
+    sample = &sensorLatest[device];
+    rec    = &out[ALIGNED_FRAME_HEADER + (device * ALIGNED_FRAME_SENSOR_SIZE)];
+
+    rec[0]  = 0;
+    rec[1]  = (sample->diffCap  >> 16) & 0xFF;
+    rec[2]  = (sample->diffCap  >>  8) & 0xFF;
+    rec[3]  = (sample->diffCap       ) & 0xFF;
+    rec[4]  = 0;
+    rec[5]  = (sample->filtCap  >> 16) & 0xFF;
+    rec[6]  = (sample->filtCap  >>  8) & 0xFF;
+    rec[7]  = (sample->filtCap       ) & 0xFF;
+    rec[8]  = 0;
+    rec[9]  = (sample->c1       >> 16) & 0xFF;
+    rec[10] = (sample->c1       >>  8) & 0xFF;
+    rec[11] = (sample->c1            ) & 0xFF;
+    rec[12] = 0;
+    rec[13] = (sample->c2       >> 16) & 0xFF;
+    rec[14] = (sample->c2       >>  8) & 0xFF;
+    rec[15] = (sample->c2            ) & 0xFF;
+    rec[16] = 0;
+    rec[17] = (sample->chipTemp >> 16) & 0xFF;
+    rec[18] = (sample->chipTemp >>  8) & 0xFF;
+    rec[19] = (sample->chipTemp      ) & 0xFF;
+    rec[20] = (sample->temp     >>  8) & 0xFF;
+    rec[21] = (sample->temp          ) & 0xFF;
+    rec[22] = (sample->humidity >>  8) & 0xFF;
+    rec[23] = (sample->humidity      ) & 0xFF;
+  }
+
+  return ALIGNED_FRAME_LENGTH;
 }
 
+
 /*
- *  ======== taskI2C1 ========
- *  Task for this function is created statically. See the project's .cfg file.
+ *  ======== crc16 ========
+ *  Carry a CRC-16/CCITT on over some bytes, four bits at a time.
  */
-void taskI2C1(UArg arg0, UArg arg1) {
-  taskParams p;
+uint16_t crc16(uint16_t crc, const uint8_t *data, uint32_t length) {
+
+  static const uint16_t nibble[16] = {
+    0x0000, 0x1021, 0x2042, 0x3063, 0x4084, 0x50A5, 0x60C6, 0x70E7,
+    0x8108, 0x9129, 0xA14A, 0xB16B, 0xC18C, 0xD1AD, 0xE1CE, 0xF1EF
+  };
 
-  p.device    = 1;
-  p.board     = Board_I2C1;
-  p.intline   = Board_PININ1;
-  p.intflag   = &intflag1;
-  p.handle    = i2c1;
-  p.i2cparams = i2cParams1;
-  p.trans     = i2cTransaction1;
-  p.switchcmd = &switchcmd1;
-  p.switchnew = &switchNew1;
-  p.inttime   = 0;
-  p.state     = tsPOR;
+  while (length--) {
+    crc = (crc << 4) ^ nibble[(crc >> 12) ^ (*data >> 4)];
+    crc = (crc << 4) ^ nibble[(crc >> 12) ^ (*data & 0x0F)];
+    data++;
+  }
 
-  taskI2Ccommon(p);
+  return crc;
 }
 
+
 /*
- *  ======== taskI2C2 ========
- *  Task for this function is created statically. See the project's .cfg file.
+ *  ======== crcShift ========
+ *  Apply a CRC shift matrix (one column per CRC bit) to a CRC.
  */
-void taskI2C2(UArg arg0, UArg arg1) {
-  taskParams p;
+uint16_t crcShift(const uint16_t *matrix, uint16_t crc) {
+
+  uint16_t shifted = 0;
+  int bit;
 
-  // References to the i2c particulars for this task
-  p.device    = 2;
-  p.board     = Board_I2C2;
-  p.intline   = Board_PININ2;
-  p.intflag   = &intflag2;
-  p.handle    = i2c2;
-  p.i2cparams = i2cParams2;
-  p.trans     = i2cTransaction2;
-  p.switchcmd = &switchcmd2;
-  p.switchnew = &switchNew2;
-  p.inttime   = 0;
-  p.state     = tsPOR;
+  for (bit = 0; crc != 0; bit++, crc >>= 1) {
+    if (crc & 1) {
+      shifted ^= matrix[bit];
+    }
+  }
 
-  taskI2Ccommon(p);
+  return shifted;
 }
 
+
 /*
- *  ======== taskI2C3 ========
- *  Task for this function is created statically. See the project's .cfg file.
+ *  ======== crcInit ========
+ *  Build the shift matrix of each sensor slot: column b is the CRC 1 << b moved on over the
+ *  bytes that follow the slot.
  */
-void taskI2C3(UArg arg0, UArg arg1) {
-  taskParams p;
+void crcInit(void) {
+
+  uint8_t zero[sizeof(sensorFrame_t)];
+  uint32_t follow, length;
+  uint16_t crc;
+  int device, bit;
+
+  bzero(zero, sizeof(zero));
+
+  for (device = 0; device < MAX_SENSORS; device++) {
+    for (bit = 0; bit < 16; bit++) {
 
-  p.device    = 3;
-  p.board     = Board_I2C3;
-  p.intline   = Board_PININ3;
-  p.intflag   = &intflag3;
-  p.handle    = i2c3;
-  p.i2cparams = i2cParams3;
-  p.trans     = i2cTransaction3;
-  p.switchcmd = &switchcmd3;
-  p.switchnew = &switchNew3;
-  p.inttime   = 0;
-  p.state     = tsPOR;
+      crc    = 1 << bit;
+      follow = (MAX_SENSORS - 1 - device) * sizeof(sensorFrame_t);
 
-  taskI2Ccommon(p);
+      while (follow > 0) {
+        length  = (follow > sizeof(zero)) ? sizeof(zero) : follow;
+        crc     = crc16(crc, zero, length);
+        follow -= length;
+      }
+
+      sensorSlotShift[device][bit] = crc;
+    }
+  }
 }
 
+
 /*
- *  ======== taskI2C4 ========
- *  Task for this function is created statically. See the project's .cfg file.
+ *  ======== composeCompactFrame ========
+ *  Compose the sensor data frame in the selected profile for the sensors in the mask, from the
+ *  samples composeSensorFrame last read.  Returns the length of the frame.
  */
-void taskI2C4(UArg arg0, UArg arg1) {
-  taskParams p;
+uint32_t composeCompactFrame(uint8_t *out) {
+
+  const sensorSample_t *sample;
+  uint8_t *rec = &out[COMPACT_FRAME_HEADER];
+  uint32_t now = Clock_getTicks();
+  uint16_t age;
+  int device;
+
+  out[0] = SIGNATURE0;
+  out[1] = dataSignature1;
+  out[2] = spiFrameProfile;
+  out[3] = spiSensorMask;
+
+  for (device = 0; device < MAX_SENSORS; device++) {
+
+    if (!(spiSensorMask & (1 << device))) {
+      continue;
+    }
+
+    sample = &sensorLatest[device];
+
+    if (spiFrameProfile == fpFull) {
+      putSensorFrame((sensorFrame_t *) rec, sample);
+      rec += sizeof(sensorFrame_t);
+      continue;
+    }
+
+    rec[0] = (sample->diffCap >> 16) & 0xFF;
+    rec[1] = (sample->diffCap >>  8) & 0xFF;
+    rec[2] = (sample->diffCap      ) & 0xFF;
+
+    if (spiFrameProfile == fpDiffOnly) {
+      rec[3] = (sample->filtCap >> 16) & 0xFF;
+      rec[4] = (sample->filtCap >>  8) & 0xFF;
+      rec[5] = (sample->filtCap      ) & 0xFF;
+      rec += 6;
+    } else {
+      age = diagAge(device, now);
+      rec[3] = sensorDiag[device].state;
+      rec[4] = diagStatus(device);
+      rec[5] = (age >> 8) & 0xFF;
+      rec[6] = (age     ) & 0xFF;
+      rec += 7;
+    }
+  }
 
-  p.device    = 4;
-  p.board     = Board_I2C4;
-  p.intline   = Board_PININ4;
-  p.intflag   = &intflag4;
-  p.handle    = i2c4;
-  p.i2cparams = i2cParams4;
-  p.trans     = i2cTransaction4;
-  p.switchcmd = &switchcmd4;
-  p.switchnew = &switchNew4;
-  p.inttime   = 0;
-  p.state     = tsPOR;
+  // Pad out to the shortest transfer, the rest of the buffer is left as it was
+  while ((rec - out) < COMPACT_FRAME_MIN) {
+    *rec++ = 0;
+  }
 
-  taskI2Ccommon(p);
+  return rec - out;
 }
 
+
 /*
- *  ======== taskI2C5 ========
- *  Task for this function is created statically. See the project's .cfg file.
+ *  ======== streamSample ========
+ *  Add a capacitance conversion to the sample stream of a sensor.
  */
-void taskI2C5(UArg arg0, UArg arg1) {
-  taskParams p;
+void streamSample(uint8_t device, adCapSelect cap, uint32_t counts) {
+
+  sampleStream_t *st = &sampleStream[device];
+  streamSample_t *rec;
+  bool crossed;
+  UInt key;
+
+  key = Hwi_disable();
+
+  if ((st->head - st->tail) >= SAMPLE_STREAM_DEPTH) {
+    st->tail++;
+    st->dropped++;
+  }
+
+  rec = &st->sample[st->head & (SAMPLE_STREAM_DEPTH - 1)];
+  rec->time = Clock_getTicks();
+  rec->cap  = ((uint32_t) cap << 24) | counts;
+  st->head++;
 
-  p.device    = 5;
-  p.board     = Board_I2C5;
-  p.intline   = Board_PININ5;
-  p.intflag   = &intflag5;
-  p.handle    = i2c5;
-  p.i2cparams = i2cParams5;
-  p.trans     = i2cTransaction5;
-  p.switchcmd = &switchcmd5;
-  p.switchnew = &switchNew5;
-  p.inttime   = 0;
-  p.state     = tsPOR;
+  crossed = ((st->head - st->tail) == STREAM_READY_THRESHOLD);
 
-  taskI2Ccommon(p);
+  Hwi_restore(key);
+
+  if (crossed && STREAM_FRAME_SELECTED()) {
+    dataReadyPost();
+  }
 }
 
 
+/*
+ *  ======== dataReadyPost ========
+ *  There is new data for the SPI master: raise the data ready line.
+ */
+void dataReadyPost(void) {
+
+  dataReadyCount++;
+  GPIO_write(Board_DATA_READY, Board_DATA_READY_ON);
+}
+
 
 /*
- *  ======== setupAD7746 ========
- *
+ *  ======== readStreamSample ========
+ *  Take the oldest sample off the sample stream of a sensor.  Returns false if it is empty.
  */
-int setupAD7746(I2C_Handle i2c, I2C_Transaction i2cTransaction, uint8_t device)
-{
-  uint8_t txBuffer[2];
-  uint8_t rxBuffer[4];
-  uint8_t offsH, offsL, gainH, gainL;
+bool readStreamSample(uint8_t device, streamSample_t *rec) {
 
-  Task_sleep(100);
+  sampleStream_t *st = &sampleStream[device];
+  bool found = false;
+  UInt key;
 
-  // Configure CAPACITANCE MEASUREMENT
-  // -----------------------------------------------
-  txBuffer[0]                 = AD7746_CAP_SETUP_REG;
-  txBuffer[1]                 = adcsC2D1;
-  i2cTransaction.slaveAddress = AD7746_ADDR;
-  i2cTransaction.writeBuf     = txBuffer;
-  i2cTransaction.writeCount   = 2;
-  i2cTransaction.readBuf      = rxBuffer;
-  i2cTransaction.readCount    = 0;
+  key = Hwi_disable();
 
-  if (!I2C_transfer(i2c, &i2cTransaction)) {
-    System_printf("(%d) Error in setup of AD7746 (default capacitors).\n", device);
-    System_flush();
-    return -1;
+  if (st->tail != st->head) {
+    *rec = st->sample[st->tail & (SAMPLE_STREAM_DEPTH - 1)];
+    st->tail++;
+    found = true;
   }
-  System_flush();
 
-  Task_sleep(100);
+  Hwi_restore(key);
 
-  // Configure VOLTAGE/TEMPERATURE (enable internal temperature sensor)
-  // -----------------------------------------------
-  txBuffer[0] = AD7746_VT_SETUP_REG;
-  txBuffer[1] = AD7746_VT_SETUP_INT_TEMP;
+  return found;
+}
 
-  if (!I2C_transfer(i2c, &i2cTransaction)) {
-    System_printf("(%d) Error in setup of AD7746 (setup for temperature reading).\n", device);
-    System_flush();
-    return -1;
+
+/*
+ *  ======== readStreamDropped ========
+ *  Read and reset the number of samples lost to overflow on all the sample streams, saturating
+ *  at one byte.
+ */
+uint8_t readStreamDropped(void) {
+
+  uint32_t dropped = 0;
+  UInt key;
+  int i;
+
+  key = Hwi_disable();
+  for (i = 0; i < MAX_SENSORS; i++) {
+    dropped += sampleStream[i].dropped;
+    sampleStream[i].dropped = 0;
   }
-  System_flush();
+  Hwi_restore(key);
 
-  Task_sleep(100);
+  return (dropped > 0xFF) ? 0xFF : dropped;
+}
 
-  // Configure EXCITATION
-  // -----------------------------------------------
-  txBuffer[0] = AD7746_EXC_SETUP_REG;
-  txBuffer[1] = AD7746_EXC_SET_A;
 
-  if (!I2C_transfer(i2c, &i2cTransaction)) {
-    System_printf("(%d) Error in setup of AD7746 (configuring excitation).\n", device);
-    System_flush();
-    return -1;
+/*
+ *  ======== composeStreamFrame ========
+ *  Drain as many samples as fit into the sample stream frame going out on the next SPI transfer,
+ *  taking one from each sensor in turn so that a busy sensor cannot starve the others.
+ */
+void composeStreamFrame(void) {
+
+  static uint8_t first = 0;
+  streamSample_t rec;
+  uint8_t *out;
+  uint32_t count = 0;
+  bool found = true;
+  int i, device;
+
+  bzero(spiStreamFrame, sizeof(spiStreamFrame));
+
+  spiStreamFrame[0] = SIGNATURE0;
+  spiStreamFrame[1] = SIGNATURE1_STREAM;
+  spiStreamFrame[2] = FIRMWARE_REV_0;
+  spiStreamFrame[3] = FIRMWARE_REV_1;
+  spiStreamFrame[4] = FIRMWARE_REV_2;
+
+  out = &spiStreamFrame[STREAM_FRAME_HEADER];
+
+  while ((count < STREAM_FRAME_RECORDS) && found) {
+
+    found = false;
+
+    for (i = 0; (i < MAX_SENSORS) && (count < STREAM_FRAME_RECORDS); i++) {
+
+      device = (first + i) % MAX_SENSORS;
+      if (!readStreamSample(device, &rec)) {
+        continue;
+      }
+
+      out[0] = device;
+      out[1] = (rec.time >> 24) & 0xFF;
+      out[2] = (rec.time >> 16) & 0xFF;
+      out[3] = (rec.time >>  8) & 0xFF;
+      out[4] = (rec.time      ) & 0xFF;
+      out[5] = (rec.cap  >> 24) & 0xFF;
+      out[6] = (rec.cap  >> 16) & 0xFF;
+      out[7] = (rec.cap  >>  8) & 0xFF;
+      out[8] = (rec.cap       ) & 0xFF;
+
+      out += STREAM_FRAME_RECORD_SIZE;
+      count++;
+      found = true;
+    }
   }
-  System_flush();
 
-  Task_sleep(100);
+  first = (first + 1) % MAX_SENSORS;
+
+  spiStreamFrame[5] = count;
+  spiStreamFrame[6] = readStreamDropped();
+}
+
+
+/*
+ *  ======== deltaStreamReset ========
+ *  Start the delta stream over: every channel goes out as a keyframe the next time it is sent.
+ */
+void deltaStreamReset(void) {
+
+  int device, channel;
+
+  for (device = 0; device < MAX_SENSORS; device++) {
+    for (channel = 0; channel < DELTA_CHANNELS; channel++) {
+      deltaChannel[device][channel].synced = false;
+    }
+  }
+}
+
+
+/*
+ *  ======== putVarint ========
+ *  Put a value as a varint, returning the position after it.
+ */
+uint8_t *putVarint(uint8_t *out, uint32_t value) {
+
+  while (value >= 0x80) {
+    *out++ = (value & 0x7F) | 0x80;
+    value >>= 7;
+  }
+  *out++ = value;
+
+  return out;
+}
+
+
+/*
+ *  ======== varintSize ========
+ *  Number of bytes putVarint would take for a value.
+ */
+uint32_t varintSize(uint32_t value) {
+
+  uint32_t size = 1;
+
+  while (value >= 0x80) {
+    value >>= 7;
+    size++;
+  }
+
+  return size;
+}
+
+
+/*
+ *  ======== putDeltaRecord ========
+ *  Put a sample into the delta stream frame, as a keyframe or a delta from the last sample sent on
+ *  its channel.  Returns the position after it, which is never more than DELTA_KEYFRAME_SIZE on.
+ */
+uint8_t *putDeltaRecord(uint8_t *out, uint8_t device, const streamSample_t *rec) {
+
+  uint8_t channel = (rec->cap >> 29) & 0x03;
+  uint32_t counts = rec->cap & 0xFFFFFF;
+  deltaChannel_t *ch = &deltaChannel[device][channel];
+  uint32_t dtime, zigzag;
+  int32_t dcounts;
+
+  dtime   = rec->time - ch->time;
+  dcounts = (int32_t) counts - (int32_t) ch->counts;
+  zigzag  = (dcounts < 0) ? ((~(uint32_t) dcounts) << 1) | 1 : ((uint32_t) dcounts << 1);
+
+  ch->time   = rec->time;
+  ch->counts = counts;
+
+  if (ch->synced && (ch->sinceKey < DELTA_KEYFRAME_INTERVAL) &&
+      ((1 + varintSize(dtime) + varintSize(zigzag)) < DELTA_KEYFRAME_SIZE)) {
+
+    ch->sinceKey++;
+
+    *out++ = (device << 4) | channel;
+    out = putVarint(out, dtime);
+    return putVarint(out, zigzag);
+  }
+
+  ch->synced   = true;
+  ch->sinceKey = 0;
+
+  out[0] = 0x80 | (device << 4) | channel;
+  out[1] = (rec->time >> 24) & 0xFF;
+  out[2] = (rec->time >> 16) & 0xFF;
+  out[3] = (rec->time >>  8) & 0xFF;
+  out[4] = (rec->time      ) & 0xFF;
+  out[5] = (counts    >> 16) & 0xFF;
+  out[6] = (counts    >>  8) & 0xFF;
+  out[7] = (counts         ) & 0xFF;
+
+  return out + DELTA_KEYFRAME_SIZE;
+}
+
+
+/*
+ *  ======== composeDeltaFrame ========
+ *  Drain as many samples as fit into the delta stream frame going out on the next SPI transfer,
+ *  taking one from each sensor in turn as composeStreamFrame does.
+ */
+void composeDeltaFrame(void) {
+
+  static uint8_t first = 0;
+  static uint8_t seq = 0;
+  uint8_t *end = &spiDeltaFrame[SPI_MESSAGE_LENGTH - DELTA_KEYFRAME_SIZE];
+  streamSample_t rec;
+  uint8_t *out;
+  uint32_t count = 0;
+  uint32_t size;
+  bool found = true;
+  int i, device;
+
+  bzero(spiDeltaFrame, sizeof(spiDeltaFrame));
+
+  spiDeltaFrame[0] = SIGNATURE0;
+  spiDeltaFrame[1] = SIGNATURE1_DELTA;
+  spiDeltaFrame[2] = FIRMWARE_REV_0;
+  spiDeltaFrame[3] = FIRMWARE_REV_1;
+  spiDeltaFrame[4] = FIRMWARE_REV_2;
+
+  out = &spiDeltaFrame[DELTA_FRAME_HEADER];
+
+  // Only take a sample off a stream while the longest record still fits
+  while ((out <= end) && (count < 0xFF) && found) {
+
+    found = false;
+
+    for (i = 0; (i < MAX_SENSORS) && (out <= end) && (count < 0xFF); i++) {
+
+      device = (first + i) % MAX_SENSORS;
+      if (!readStreamSample(device, &rec)) {
+        continue;
+      }
+
+      out = putDeltaRecord(out, device, &rec);
+      count++;
+      found = true;
+    }
+  }
+
+  first = (first + 1) % MAX_SENSORS;
+
+  size = out - &spiDeltaFrame[DELTA_FRAME_HEADER];
+
+  spiDeltaFrame[5] = seq++;
+  spiDeltaFrame[6] = count;
+  spiDeltaFrame[7] = readStreamDropped();
+  spiDeltaFrame[8] = (size >> 8) & 0xFF;
+  spiDeltaFrame[9] = (size     ) & 0xFF;
+}
+
+
+/*
+ *  ======== eventLogIdleFxn ========
+ *  Idle task hook (see the project's .cfg file).  With EVENT_LOG_CONSOLE defined, drains the
+ *  event log to the CCS console as raw numbers; otherwise the log is left for the SPI master.
+ */
+void eventLogIdleFxn(void) {
+
+#ifdef EVENT_LOG_CONSOLE
+  eventRecord_t rec;
+
+  while (readEvent(&rec)) {
+    System_printf("E %u %u %u %u %u %u\n", rec.time, rec.id, rec.device, rec.arg[0], rec.arg[1], rec.arg[2]);
+  }
+  System_flush();
+#endif
+}
+
+
+/*
+ *  ======== diagSample ========
+ *  Account for a good capacitance sample in the diagnostics of a sensor.
+ */
+void diagSample(uint8_t device) {
+
+  sensorDiag_t *d = &sensorDiag[device];
+  uint32_t now = Clock_getTicks();
+  uint32_t elapsed;
+
+  if (!d->sampled) {
+    d->rateWindowStart = now;
+    d->rateWindowCount = 0;
+    bootDone(device, true);
+  }
+
+  d->sampled        = true;
+  d->lastSampleTime = now;
+  d->rateWindowCount++;
+
+  elapsed = now - d->rateWindowStart;
+  if (elapsed >= DIAG_RATE_WINDOW_MS) {
+    d->sampleRate      = (d->rateWindowCount * 100000) / elapsed;
+    d->rateWindowStart = now;
+    d->rateWindowCount = 0;
+  }
+}
+
+
+/*
+ *  ======== bootDone ========
+ *  A sensor has produced its first sample, or failed its first init.  Once every sensor is done
+ *  the sensor data frame goes out with its normal signature.
+ */
+void bootDone(uint8_t device, bool sampled) {
+
+  uint32_t now = Clock_getTicks();
+
+  if (sampled && !bootSampled) {
+    bootSampled     = true;
+    bootFirstSample = now;
+  }
+
+  if (bootPending & (1 << device)) {
+
+    bootPending &= ~(1 << device);
+
+    if (bootPending == 0) {
+      bootReady      = now;
+      dataSignature1 = SIGNATURE1;
+
+      logEvent(evBootReady, device, bootReady, bootSampled ? bootFirstSample : DIAG_NEVER, 0);
+    }
+  }
+}
+
+
+/*
+ *  ======== diagStatus ========
+ *  Status flags (DIAG_STATUS_*) of a sensor.
+ */
+uint8_t diagStatus(uint8_t device) {
+
+  sensorDiag_t *d = &sensorDiag[device];
+  uint8_t status = 0;
+
+  if (d->hdcOK)                  status |= DIAG_STATUS_HDC_OK;
+  if (d->state == tsRunning)     status |= DIAG_STATUS_RUNNING;
+  if (d->relayMoving)            status |= DIAG_STATUS_RELAY_MOVING;
+  if (d->relaySample)            status |= DIAG_STATUS_RELAY_SAMPLE;
+  if (relayPosition[device] == PCA9536_OUT_PORT_NEW_ACS) status |= DIAG_STATUS_RELAY_NEW;
+  if (d->i2cFast)                status |= DIAG_STATUS_I2C_FAST;
+
+  return status;
+}
+
+
+/*
+ *  ======== diagAge ========
+ *  ms since the last good sample of a sensor, saturating at DIAG_NEVER, which it also is if there
+ *  has not been one yet.
+ */
+uint16_t diagAge(uint8_t device, uint32_t now) {
+
+  sensorDiag_t *d = &sensorDiag[device];
+  uint32_t age;
+
+  age = d->sampled ? (now - d->lastSampleTime) : DIAG_NEVER;
+  if (age > DIAG_NEVER) age = DIAG_NEVER;
+
+  return age;
+}
+
+
+/*
+ *  ======== composeDiagFrame ========
+ *  Build the diagnostics frame going out on the next SPI transfer.
+ */
+void composeDiagFrame(void) {
+
+  sensorDiag_t *d;
+  uint8_t *out;
+  uint32_t now = Clock_getTicks();
+  uint32_t age, count;
+  int i, tier;
+
+  bzero(spiDiagFrame, sizeof(spiDiagFrame));
+
+  spiDiagFrame[0] = SIGNATURE0;
+  spiDiagFrame[1] = SIGNATURE1_DIAG;
+  spiDiagFrame[2] = FIRMWARE_REV_0;
+  spiDiagFrame[3] = FIRMWARE_REV_1;
+  spiDiagFrame[4] = FIRMWARE_REV_2;
+
+  for (i = 0; i < MAX_SENSORS; i++) {
+
+    d   = &sensorDiag[i];
+    out = &spiDiagFrame[DIAG_FRAME_HEADER + (i * DIAG_FRAME_SENSOR_SIZE)];
+
+    age = diagAge(i, now);
+
+    out[0]  = d->state;
+    out[1]  = diagStatus(i);
+    out[2]  = (d->i2cFailures >>  8) & 0xFF;
+    out[3]  = (d->i2cFailures      ) & 0xFF;
+    out[4]  = (d->timeouts    >>  8) & 0xFF;
+    out[5]  = (d->timeouts         ) & 0xFF;
+    out[6]  = (d->reinits     >>  8) & 0xFF;
+    out[7]  = (d->reinits          ) & 0xFF;
+    out[8]  = (d->sampleRate  >>  8) & 0xFF;
+    out[9]  = (d->sampleRate       ) & 0xFF;
+    out[10] = (age            >>  8) & 0xFF;
+    out[11] = (age                 ) & 0xFF;
+    out[12] = (d->i2cTransfers >> 24) & 0xFF;
+    out[13] = (d->i2cTransfers >> 16) & 0xFF;
+    out[14] = (d->i2cTransfers >>  8) & 0xFF;
+    out[15] = (d->i2cTransfers      ) & 0xFF;
+  }
+
+  relayGroupUpdate();
+
+  out = &spiDiagFrame[DIAG_FRAME_RELAY];
+  out[0] = relayGroup.seq;
+  out[1] = relayGroup.status;
+  out[2] = relayGroup.targets & 0xFF;
+  out[3] = relayGroup.done    & 0xFF;
+  out[4] = relayGroup.failed  & 0xFF;
+
+  out = &spiDiagFrame[DIAG_FRAME_BOOT];
+  age = bootSampled ? bootFirstSample : DIAG_NEVER;
+  if (age > DIAG_NEVER) age = DIAG_NEVER;
+  out[0] = (age >> 8) & 0xFF;
+  out[1] = (age     ) & 0xFF;
+  age = (bootPending == 0) ? bootReady : DIAG_NEVER;
+  if (age > DIAG_NEVER) age = DIAG_NEVER;
+  out[2] = (age >> 8) & 0xFF;
+  out[3] = (age     ) & 0xFF;
+
+  out = &spiDiagFrame[DIAG_FRAME_RECOVERY];
+  for (tier = 0; tier < RECOVERY_TIERS; tier++) {
+
+    count = 0;
+    for (i = 0; i < MAX_SENSORS; i++) {
+      count += sensorDiag[i].recoveries[tier];
+    }
+
+    out[(tier * 2)    ] = (count >> 8) & 0xFF;
+    out[(tier * 2) + 1] = (count     ) & 0xFF;
+  }
+}
+
+
+
+/*
+ *  ======== putStackUsage ========
+ *  One stack entry of the resources frame.
+ */
+void putStackUsage(uint8_t *out, uint32_t size, uint32_t used) {
+
+  out[0] = (size >> 8) & 0xFF;
+  out[1] = (size     ) & 0xFF;
+  out[2] = (used >> 8) & 0xFF;
+  out[3] = (used     ) & 0xFF;
+}
+
+
+/*
+ *  ======== composeResFrame ========
+ *  Build the resources frame going out on the next SPI transfer: stack high-water marks and heap
+ *  usage.  Finding the high-water marks means scanning every stack, so this is only done while
+ *  the frame is selected.
+ */
+void composeResFrame(void) {
+
+  Task_Handle tasks[RES_FRAME_TASKS];
+  Task_Stat stat;
+  Hwi_StackInfo stack;
+  Memory_Stats heap;
+  uint8_t *out;
+  int i;
+
+  tasks[0] = sensorExec;
+  tasks[1] = slaveTask;
+  tasks[2] = Task_getIdleTask();
+
+  bzero(spiResFrame, sizeof(spiResFrame));
+
+  spiResFrame[0] = SIGNATURE0;
+  spiResFrame[1] = SIGNATURE1_RESOURCES;
+  spiResFrame[2] = FIRMWARE_REV_0;
+  spiResFrame[3] = FIRMWARE_REV_1;
+  spiResFrame[4] = FIRMWARE_REV_2;
+
+  for (i = 0; i < RES_FRAME_TASKS; i++) {
+    Task_stat(tasks[i], &stat);
+    putStackUsage(&spiResFrame[RES_FRAME_HEADER + (i * RES_FRAME_STACK_SIZE)], stat.stackSize, stat.used);
+  }
+
+  Hwi_getStackInfo(&stack, TRUE);
+  putStackUsage(&spiResFrame[RES_FRAME_SYSTEM], stack.hwiStackSize, stack.hwiStackPeak);
+
+  Memory_getStats(NULL, &heap);
+  out = &spiResFrame[RES_FRAME_HEAP];
+  out[0] = (heap.totalSize       >> 8) & 0xFF;
+  out[1] = (heap.totalSize            ) & 0xFF;
+  out[2] = (heap.totalFreeSize   >> 8) & 0xFF;
+  out[3] = (heap.totalFreeSize        ) & 0xFF;
+  out[4] = (heap.largestFreeSize >> 8) & 0xFF;
+  out[5] = (heap.largestFreeSize      ) & 0xFF;
+
+  out = &spiResFrame[RES_FRAME_SPI];
+  out[0] = (spiLinkStats.transfers       >> 24) & 0xFF;
+  out[1] = (spiLinkStats.transfers       >> 16) & 0xFF;
+  out[2] = (spiLinkStats.transfers       >>  8) & 0xFF;
+  out[3] = (spiLinkStats.transfers            ) & 0xFF;
+  out[4] = (spiLinkStats.repeats         >>  8) & 0xFF;
+  out[5] = (spiLinkStats.repeats              ) & 0xFF;
+  out[6] = (spiLinkStats.failed          >>  8) & 0xFF;
+  out[7] = (spiLinkStats.failed               ) & 0xFF;
+  out[8] = (spiLinkStats.commandsDropped >>  8) & 0xFF;
+  out[9] = (spiLinkStats.commandsDropped      ) & 0xFF;
+  out[10] = (spiLinkStats.crcErrors      >>  8) & 0xFF;
+  out[11] = (spiLinkStats.crcErrors           ) & 0xFF;
+}
+
+
+/*
+ *  ======== transferI2C ========
+ *  All sensor I2C traffic goes through here so it is counted in the diagnostics.  A transfer
+ *  that fails on a running sensor is retried, the first tier of fault recovery.
+ */
+bool transferI2C(I2C_Handle i2c, I2C_Transaction *i2cTransaction, uint8_t device) {
+
+  sensorDiag_t *d = &sensorDiag[device];
+  sensorBus_t *b = &sensorBus[sensorConfig[device].bus];
+  int retries = (d->state == tsRunning) ? I2C_RETRIES : 0;
+  bool ok;
+
+  ok = transferOnceI2C(i2c, i2cTransaction, device);
+
+  // First tier of fault recovery: a one-off glitch on a running sensor is just retried.  There is
+  // no point retrying on a stuck bus, or for a sensor that may simply not be there.
+  while (!ok && !b->stuck && (retries-- > 0)) {
+    d->recoveries[rtRetry]++;
+    ok = transferOnceI2C(i2c, i2cTransaction, device);
+  }
+
+  return ok;
+}
+
+
+/*
+ *  ======== transferOnceI2C ========
+ *  A single attempt at a transfer, see transferI2C.  The transfer goes out on the bus the sensor
+ *  is on, through its multiplexer channel.  The 'i2c' handle is not used: the bus may have been
+ *  re-opened by another sensor since the caller was given it.
+ */
+bool transferOnceI2C(I2C_Handle i2c, I2C_Transaction *i2cTransaction, uint8_t device) {
+
+  sensorDiag_t *d = &sensorDiag[device];
+  uint8_t bus = sensorConfig[device].bus;
+  sensorBus_t *b = &sensorBus[bus];
+  bool ok, stuck;
+
+  // The bus is closed until it has been cleared
+  if (b->stuck || !b->open) {
+    return false;
+  }
+
+  ok = selectMuxI2C(device) && transferBusI2C(bus, i2cTransaction);
+  stuck = b->stuck;
+
+  // Track the error rate of a fast bus.  Only count while running, since a disconnected sensor
+  // fails every transfer during init and says nothing about the bus speed.
+  if (b->fast && !b->fallback && (d->state == tsRunning)) {
+
+    b->errWindowTransfers++;
+    if (!ok) {
+      b->errWindowFailures++;
+    }
+
+    if (b->errWindowFailures >= I2C_FALLBACK_FAILURES) {
+      b->fallback = true;
+
+    } else if (b->errWindowTransfers >= I2C_ERROR_WINDOW) {
+      b->errWindowTransfers = 0;
+      b->errWindowFailures = 0;
+    }
+  }
+
+  if (stuck) {
+    logEvent(evI2CTimeout, device, i2cTransaction->slaveAddress, 0, 0);
+  }
+
+  d->i2cTransfers++;
+  if (!ok) {
+    d->i2cFailures++;
+  }
+
+  return ok;
+}
+
+
+/*
+ *  ======== selectMuxI2C ========
+ *  Connect the sensor's multiplexer channel to the bus, unless it already is (or the sensor has
+ *  no multiplexer).  Only runs from the executive (sensorExecFxn), so needs no locking.
+ */
+bool selectMuxI2C(uint8_t device) {
+
+  const sensorConfig_t *cfg = &sensorConfig[device];
+  sensorBus_t *b = &sensorBus[cfg->bus];
+  I2C_Transaction i2cTransaction;
+  uint8_t txBuffer[1];
+
+  if ((cfg->mux == TCA9548_NONE) || (b->channel == cfg->channel)) {
+    return true;
+  }
+
+  txBuffer[0]                 = 1 << cfg->channel;
+  i2cTransaction.slaveAddress = cfg->mux;
+  i2cTransaction.writeBuf     = txBuffer;
+  i2cTransaction.writeCount   = 1;
+  i2cTransaction.readBuf      = NULL;
+  i2cTransaction.readCount    = 0;
+
+  if (!transferBusI2C(cfg->bus, &i2cTransaction)) {
+    b->channel = TCA9548_CHANNEL_UNKNOWN;
+    return false;
+  }
+
+  b->channel = cfg->channel;
+  return true;
+}
+
+
+/*
+ *  ======== transferBusI2C ========
+ *  Run a transfer on a bus and wait for it, closing the bus and marking it stuck if it takes
+ *  longer than I2C_TRANSFER_TIMEOUT_MS.  Only runs from the executive (sensorExecFxn), so needs
+ *  no locking.
+ */
+bool transferBusI2C(uint8_t bus, I2C_Transaction *i2cTransaction) {
+
+  sensorBus_t *b = &sensorBus[bus];
+  Event_Handle event = Event_handle(&execEvent);
+  bool ok;
+
+#ifdef I2C_ENGINE
+  i2cEngineTransaction trans;
+
+  trans.slaveAddress = i2cTransaction->slaveAddress;
+  trans.writeBuf     = i2cTransaction->writeBuf;
+  trans.writeCount   = i2cTransaction->writeCount;
+  trans.readBuf      = i2cTransaction->readBuf;
+  trans.readCount    = i2cTransaction->readCount;
+  trans.callback     = transferDoneEngine;
+  trans.arg          = (UArg) b;
+
+  // The engine callback posts the same bus event as the I2CTiva one, see below
+  Event_pend(event, Event_Id_NONE, EXEC_EVENT_BUS(bus), BIOS_NO_WAIT);
+
+  if (!i2cEngineSubmit(bus, &trans)) {
+    ok = false;
+
+  } else if (Event_pend(event, Event_Id_NONE, EXEC_EVENT_BUS(bus), I2C_TRANSFER_TIMEOUT_MS)) {
+    ok = (trans.status == i2cesDone);
+
+  } else {
+    // Closing the bus fails the transaction and takes it off the engine's queue
+    i2cEngineClose(bus);
+    b->open  = false;
+    b->stuck = true;
+    ok = false;
+  }
+#else
+  // Clear any completion left over from a transfer that was given up on.  Only the bus's own
+  // event is waited for here; sensor events stay posted for the executive.
+  i2cTransaction->arg = b;
+  Event_pend(event, Event_Id_NONE, EXEC_EVENT_BUS(bus), BIOS_NO_WAIT);
+
+  if (!I2C_transfer(b->handle, i2cTransaction)) {
+    ok = false;
+
+  } else if (Event_pend(event, Event_Id_NONE, EXEC_EVENT_BUS(bus), I2C_TRANSFER_TIMEOUT_MS)) {
+    ok = b->ok;
+
+  } else {
+    // Stuck, most likely a slave holding SDA low.  Close the bus now so the driver lets go of the
+    // transaction, which lives on the caller's stack; the sensor then clears and re-opens it.
+    I2C_close(b->handle);
+    b->handle = NULL;
+    b->open   = false;
+    b->stuck  = true;
+    ok = false;
+  }
+#endif
+
+  return ok;
+}
+
+
+/*
+ *  ======== openI2C ========
+ *  Open the sensor's bus at the fastest speed it is allowed, unless another sensor on the bus has
+ *  already done so.  A bus open at 400kHz that has since fallen back is re-opened at 100kHz.
+ */
+void openI2C(taskParams *p) {
+
+  sensorBus_t *b = &sensorBus[p->bus];
+  bool fast;
+
+#ifndef I2C_ENGINE
+  I2C_Params i2cParams;
+#endif
+
+  fast = i2cFastMode[p->bus] && !b->fallback;
+
+  if (!b->open || (b->fast != fast)) {
+
+    b->fast = fast;
+
+#ifdef I2C_ENGINE
+    // The engine is addressed by bus number, there is no handle
+    i2cEngineOpen(p->bus, fast);
+#else
+    if (b->handle != NULL) {
+      I2C_close(b->handle);
+    }
+
+    /* Create I2C for usage */
+    I2C_Params_init(&i2cParams);
+
+    // Set I2C communication speed
+    i2cParams.bitRate = fast ? I2C_400kHz : I2C_100kHz;
+
+    // Callback mode, so that transferBusI2C can put a time limit on each transfer
+    i2cParams.transferMode        = I2C_MODE_CALLBACK;
+    i2cParams.transferCallbackFxn = transferDoneI2C;
+
+    // Open the I2C
+    b->handle = I2C_open(p->bus, &i2cParams);
+
+    // Check that opening was successful, else kill the system
+    if (b->handle == NULL) {
+      System_abort("Error initializing I2C.\n");
+    }
+#endif
+
+    b->open    = true;
+    b->channel = TCA9548_CHANNEL_UNKNOWN;
+    b->errWindowTransfers = 0;
+    b->errWindowFailures = 0;
+  }
+
+  p->handle = b->handle;
+  sensorDiag[p->device].i2cFast = b->fast;
+}
+
+
+/*
+ *  ======== transferDoneI2C ========
+ *  I2C driver callback, wakes up the executive waiting in transferBusI2C.
+ */
+void transferDoneI2C(I2C_Handle handle, I2C_Transaction *i2cTransaction, bool ok) {
+
+  sensorBus_t *b = (sensorBus_t *) i2cTransaction->arg;
+
+  b->ok = ok;
+  Event_post(Event_handle(&execEvent), EXEC_EVENT_BUS(b - sensorBus));
+}
+
+
+#ifdef I2C_ENGINE
+/*
+ *  ======== transferDoneEngine ========
+ *  I2C engine callback, from the I2C interrupt.  Wakes up the executive the same way.
+ */
+void transferDoneEngine(i2cEngineTransaction *trans) {
+
+  sensorBus_t *b = (sensorBus_t *) trans->arg;
+
+  Event_post(Event_handle(&execEvent), EXEC_EVENT_BUS(b - sensorBus));
+}
+#endif
+
+
+/*
+ *  ======== recoverI2C ========
+ *  Clear a bus that transferBusI2C found stuck: clock SCL until the slave lets go of SDA, reset the
+ *  I2C peripheral and re-open the bus.  Takes well under a millisecond.  Only the first sensor on
+ *  the bus to get here clears it.
+ */
+void recoverI2C(taskParams *p) {
+
+  sensorBus_t *b = &sensorBus[p->bus];
+  uint32_t start = Clock_getTicks();
+  bool released;
+
+  if (!b->stuck) {
+    return;
+  }
+
+  released = Board_recoverI2C(p->bus);
+  b->stuck = false;
+
+  openI2C(p);
+
+  logEvent(evI2CBusCleared, p->device, released, Clock_getTicks() - start, 0);
+}
+
+
+#ifdef I2C_BENCHMARK
+
+/* Benchmark transaction: read back the AD7746 setup registers, 1 byte written and 6 read */
+#define BENCH_TRANSFERS           200
+#define BENCH_GAP_CYCLES          100   // A longer gap in the spin loop was taken by an interrupt
+
+volatile bool benchDone;
+volatile bool benchOK;
+
+/*
+ *  ======== benchmarkSpin ========
+ *  Spin until the transfer in progress completes, adding the time taken away from the loop by
+ *  interrupts to 'busy'.  Returns the total time spun.  Task switching is disabled by the caller,
+ *  so only interrupt (and Swi) time is counted.
+ */
+uint32_t benchmarkSpin(uint32_t *busy) {
+
+  uint32_t start = Timestamp_get32();
+  uint32_t last = start;
+  uint32_t now;
+
+  while (!benchDone) {
+    now = Timestamp_get32();
+    if ((now - last) > BENCH_GAP_CYCLES) {
+      *busy += now - last;
+    }
+    last = now;
+  }
+
+  return last - start;
+}
+
+void benchmarkTivaDone(I2C_Handle handle, I2C_Transaction *trans, bool ok) {
+  benchOK = ok;
+  benchDone = true;
+}
+
+void benchmarkEngineDone(i2cEngineTransaction *trans) {
+  benchOK = (trans->status == i2cesDone);
+  benchDone = true;
+}
+
+/*
+ *  ======== benchmarkI2C ========
+ *  Run the same transaction BENCH_TRANSFERS times through I2CTiva (in callback mode, so the CPU
+ *  time it takes can be seen from a spin loop) and then through the I2C engine, and print the
+ *  average latency and CPU time per transaction for each.  The CPU time includes the call that
+ *  starts the transfer.
+ */
+void benchmarkI2C(taskParams *p) {
+
+  uint8_t txBuffer[1];
+  uint8_t rxBuffer[AD7746_SHADOW_COUNT];
+  Types_FreqHz freq;
+  I2C_Params params;
+  I2C_Handle handle;
+  I2C_Transaction trans;
+  i2cEngineTransaction etrans;
+  uint32_t latency, busy, failed, t0, cyclesPerUs;
+  UInt key;
+  int i;
+
+  Timestamp_getFreq(&freq);
+  cyclesPerUs = freq.lo / 1000000;
+
+  txBuffer[0] = AD7746_SHADOW_FIRST;
+
+  // I2CTiva
+  I2C_Params_init(&params);
+  params.bitRate             = i2cFastMode[p->bus] ? I2C_400kHz : I2C_100kHz;
+  params.transferMode        = I2C_MODE_CALLBACK;
+  params.transferCallbackFxn = benchmarkTivaDone;
+  handle = I2C_open(p->bus, &params);
+
+  if (handle == NULL) {
+    System_abort("Error initializing I2C.\n");
+  }
+
+  trans.slaveAddress = AD7746_ADDR;
+  trans.writeBuf     = txBuffer;
+  trans.writeCount   = 1;
+  trans.readBuf      = rxBuffer;
+  trans.readCount    = AD7746_SHADOW_COUNT;
+
+  latency = busy = failed = 0;
+  key = Task_disable();
+
+  for (i = 0; i < BENCH_TRANSFERS; i++) {
+    benchDone = false;
+    t0 = Timestamp_get32();
+    I2C_transfer(handle, &trans);
+    busy += Timestamp_get32() - t0;
+    benchmarkSpin(&busy);
+    latency += Timestamp_get32() - t0;
+    if (!benchOK) failed++;
+  }
+
+  Task_restore(key);
+  I2C_close(handle);
+
+  System_printf("I2CTiva: %d transfers, %d failed, latency %d us, CPU %d us\n", BENCH_TRANSFERS, failed,
+                latency / BENCH_TRANSFERS / cyclesPerUs, busy / BENCH_TRANSFERS / cyclesPerUs);
+  System_flush();
+
+  // I2C engine
+  i2cEngineOpen(p->bus, i2cFastMode[p->bus]);
+
+  etrans.slaveAddress = AD7746_ADDR;
+  etrans.writeBuf     = txBuffer;
+  etrans.writeCount   = 1;
+  etrans.readBuf      = rxBuffer;
+  etrans.readCount    = AD7746_SHADOW_COUNT;
+  etrans.callback     = benchmarkEngineDone;
+
+  latency = busy = failed = 0;
+  key = Task_disable();
+
+  for (i = 0; i < BENCH_TRANSFERS; i++) {
+    benchDone = false;
+    t0 = Timestamp_get32();
+    i2cEngineSubmit(p->bus, &etrans);
+    busy += Timestamp_get32() - t0;
+    benchmarkSpin(&busy);
+    latency += Timestamp_get32() - t0;
+    if (!benchOK) failed++;
+  }
+
+  Task_restore(key);
+
+  System_printf("I2C engine: %d transfers, %d failed, latency %d us, CPU %d us (%d us in the interrupt)\n",
+                BENCH_TRANSFERS, failed, latency / BENCH_TRANSFERS / cyclesPerUs,
+                busy / BENCH_TRANSFERS / cyclesPerUs,
+                i2cEngineIsrCycles[p->bus] / BENCH_TRANSFERS / cyclesPerUs);
+  System_flush();
+
+  i2cEngineClose(p->bus);
+}
+
+#endif
+
+
+#ifdef EXEC_BENCHMARK
+
+#define EXEC_BENCH_SAMPLES        1000
+
+/*
+ *  ======== benchmarkExec ========
+ *  Add the time from the conversion complete interrupt to the executive picking it up, and print
+ *  the mean and worst case every EXEC_BENCH_SAMPLES conversions.
+ */
+void benchmarkExec(taskParams *p) {
+
+  Types_FreqHz freq;
+  uint32_t latency, cyclesPerUs;
+
+  latency = Timestamp_get32() - execRdyTime[p->device];
+
+  p->benchtotal += latency;
+  if (latency > p->benchmax) p->benchmax = latency;
+
+  if (++p->benchcount < EXEC_BENCH_SAMPLES) {
+    return;
+  }
+
+  Timestamp_getFreq(&freq);
+  cyclesPerUs = freq.lo / 1000000;
+
+  System_printf("(%d) Executive latency: mean %d us, max %d us over %d conversions\n", p->device,
+                p->benchtotal / p->benchcount / cyclesPerUs, p->benchmax / cyclesPerUs, p->benchcount);
+  System_flush();
+
+  p->benchcount = 0;
+  p->benchtotal = 0;
+  p->benchmax   = 0;
+}
+
+#endif
+
+
+/* *  ======== slaveTaskFxn ========
+ *  Task function for slave task.
+ *
+ *  Slave SPI sends a message to master and also
+ *  receives message from master.  The transfers
+ *  themselves are kept going by slaveSpiDone; this
+ *  task handles the commands and composes the frames
+ *  between them.  Task for this function is created
+ *  statically. See the project's .cfg file.
+ */
+void slaveTaskFxn (UArg arg0, UArg arg1) {
+
+  Semaphore_Handle done = Semaphore_handle(&slaveSpiDoneStruct);
+  spiCommand_t cmd;
+  regResult_t res;
+
+  /* Start serving frames straight away; until the sensors have come up the data frame goes out
+   * marked not ready (SIGNATURE1_NOT_READY) */
+  openSlaveSpi(false);
+
+  while (1) {
+
+    /* Wait for a transfer to finish; the next one is already armed */
+    Semaphore_pend(done, BIOS_WAIT_FOREVER);
+
+    /* Check the group relay switch against its deadline */
+    relayGroupUpdate();
+
+    /* Process the task commands, keeping their results for the acknowledgement block, along
+     * with those of the register operations the executive has finished */
+    while (readCommand(&cmd)) {
+      ackCommand(cmd.seq, slaveTaskCommand(&cmd), 0);
+    }
+
+    while (readRegResult(&res)) {
+      ackCommand(res.seq, (commandStatus) res.status, res.data);
+    }
+
+    /* Switch the SSI data frame size if the layout now calls for the other one */
+    if ((spiFrameLayout == flAligned16) != spiWide) {
+
+      spiReopen = true;
+      SPI_transferCancel(slaveSpi);
+      SPI_close(slaveSpi);
+      spiReopen = false;
+
+      openSlaveSpi(spiFrameLayout == flAligned16);
+      continue;
+    }
+
+    /* Each message from the BBB will indicate if fast or slow conversion is being used */
+    if (spiFastConversion) {
+
+        /* Use fast conversion time (38.0ms i.e 26.3Hz) */
+        adAllSensorConversionTime = FAST_CONVERSION_TIME; // adct38msSingle
+
+    } else {
+
+        /* Use slow conversion time (109ms i.e 9Hz) */
+        adAllSensorConversionTime = DEFAULT_CONVERSION_TIME; // adct109msSingle
+    }
+
+    /* Compose the next frame into the buffer that is not armed, unless that is still waiting */
+    if (!spiTxNextReady) {
+      composeTxBuf(spiTxArmed ^ 1);
+      spiTxNextReady = true;
+    }
+  }
+
+}
+
+
+/*
+ *  ======== slaveSpiDone ========
+ *  SPI completion callback.  Copies anything the slave task needs out of the receive buffer and
+ *  re-arms the transfer straight away, with the next frame if the slave task has composed one.
+ */
+void slaveSpiDone(SPI_Handle handle, SPI_Transaction *transaction) {
+
+  uint32_t received;
+
+  /* The slave task is closing the driver, do not re-arm */
+  if (spiReopen) {
+    return;
+  }
+
+  spiLinkStats.transfers++;
+
+  /* Bytes received, put back in wire order if need be (see frameLayout) */
+  received = transaction->count;
+  if (spiWide) {
+    received *= 2;
+    swapBytePairs(spiMessageIn.buf, received);
+  }
+
+  if (transaction->status != SPI_TRANSFER_COMPLETED) {
+    spiLinkStats.failed++;
+
+  } else if (spiTxCrc[spiTxArmed] &&
+             (crc16(CRC16_INIT, spiMessageIn.buf, offsetof(spiMessageIn_t, crcHigh)) !=
+              ((spiMessageIn.crcHigh << 8) | spiMessageIn.crcLow))) {
+    spiLinkStats.crcErrors++;
+
+  } else {
+
+    spiFastConversion = (bool) spiMessageIn.useFastConversionTime;
+
+    /* If the first byte of the rx buffer is not a 0, it is a command or a batch of them */
+    if (spiMessageIn.cmd0 == SPI_BATCH_MARKER) {
+      queueBatch(received, spiTxCrc[spiTxArmed]);
+    } else if (spiMessageIn.cmd0 != 0) {
+      queueCommand(spiMessageIn.buf, 0);
+    }
+  }
+
+  if (spiTxNextReady) {
+    spiTxArmed ^= 1;
+    spiTxNextReady = false;
+  } else {
+    spiLinkStats.repeats++;
+  }
+
+  transaction->count = spiTxCount[spiTxArmed];
+  transaction->txBuf = spiTxBuf[spiTxArmed];
+  SPI_transfer(handle, transaction);
+
+  /* Keep the data ready line up if there is data newer than the frame now armed */
+  if (dataReadyCount == spiTxDataCount[spiTxArmed]) {
+    GPIO_write(Board_DATA_READY, Board_DATA_READY_OFF);
+  }
+
+  Semaphore_post(Semaphore_handle(&slaveSpiDoneStruct));
+}
+
+
+/*
+ *  ======== queueCommand ========
+ *  Queue a command (cmd0..cmd3) for the slave task, from slaveSpiDone.
+ */
+void queueCommand(const uint8_t *cmd, uint8_t seq) {
+
+  spiCommand_t *q;
+
+  if ((spiCommandHead - spiCommandTail) >= SPI_COMMAND_QUEUE) {
+    spiLinkStats.commandsDropped++;
+    return;
+  }
+
+  q = &spiCommandQueue[spiCommandHead & (SPI_COMMAND_QUEUE - 1)];
+  q->cmd0 = cmd[0];
+  q->cmd1 = cmd[1];
+  q->cmd2 = cmd[2];
+  q->cmd3 = cmd[3];
+  q->seq  = seq;
+  spiCommandHead++;
+}
+
+
+/*
+ *  ======== queueBatch ========
+ *  Queue the batch of commands in the message just received, from slaveSpiDone.  'received' is
+ *  the number of bytes in the message, and 'crc' whether its entries carry a CRC.
+ */
+void queueBatch(uint32_t received, bool crc) {
+
+  const uint8_t *entry = &spiMessageIn.buf[SPI_BATCH_OFFSET];
+  uint32_t count = spiMessageIn.cmd1;
+  uint32_t size = count * SPI_BATCH_ENTRY_SIZE;
+  uint32_t i;
+
+  if ((count == 0) || (count > SPI_BATCH_MAX) ||
+      ((SPI_BATCH_OFFSET + size + (crc ? SPI_CRC_SIZE : 0)) > received)) {
+    spiLinkStats.commandsDropped += count;
+    return;
+  }
+
+  if (crc && (crc16(CRC16_INIT, entry, size) != ((entry[size] << 8) | entry[size + 1]))) {
+    spiLinkStats.crcErrors++;
+    return;
+  }
+
+  if ((spiCommandHead - spiCommandTail) > (SPI_COMMAND_QUEUE - count)) {
+    spiLinkStats.commandsDropped += count;
+    return;
+  }
+
+  for (i = 0; i < count; i++, entry += SPI_BATCH_ENTRY_SIZE) {
+    queueCommand(&entry[1], entry[0]);
+  }
+}
+
+
+/*
+ *  ======== readCommand ========
+ *  Take the oldest command off the queue filled by slaveSpiDone.  Returns false if it is empty.
+ */
+bool readCommand(spiCommand_t *cmd) {
+
+  UInt key;
+  bool found = false;
+
+  key = Hwi_disable();
+
+  if (spiCommandTail != spiCommandHead) {
+    *cmd = spiCommandQueue[spiCommandTail & (SPI_COMMAND_QUEUE - 1)];
+    spiCommandTail++;
+    found = true;
+  }
+
+  Hwi_restore(key);
+
+  return found;
+}
+
+
+/*
+ *  ======== openSlaveSpi ========
+ *  Open the SPI slave, with 8 or 16 bit data frames, compose both transmit buffers and arm the
+ *  first transfer.
+ */
+void openSlaveSpi(bool wide) {
+
+  spiWide = wide;
+
+  spiTxArmed = 0;
+  composeTxBuf(0);
+  composeTxBuf(1);
+  spiTxNextReady = true;
+
+  /* Initialize SPI handle with slave mode */
+  SPI_Params_init(&slaveSpiParams);
+  slaveSpiParams.mode                = SPI_SLAVE;
+  slaveSpiParams.transferMode        = SPI_MODE_CALLBACK;
+  slaveSpiParams.transferCallbackFxn = slaveSpiDone;
+  slaveSpiParams.frameFormat         = SPI_POL1_PHA1;
+  slaveSpiParams.dataSize            = wide ? 16 : 8;
+
+  slaveSpi = SPI_open(Board_SPI0, &slaveSpiParams);
+  if (slaveSpi == NULL) {
+    System_abort("slave: Error initializing SPI\n");
+  }
+
+  slaveTransaction1.count = spiTxCount[spiTxArmed];
+  slaveTransaction1.txBuf = spiTxBuf[spiTxArmed];
+  slaveTransaction1.rxBuf = spiMessageIn.buf;
+  SPI_transfer(slaveSpi, &slaveTransaction1);
+}
+
+
+/*
+ *  ======== swapBytePairs ========
+ *  Swap the bytes of each 16 bit half of a word aligned buffer, a multiple of 4 bytes long.
+ */
+void swapBytePairs(uint8_t *buf, uint32_t length) {
+
+  uint32_t *word = (uint32_t *) buf;
+  uint32_t i;
+
+  for (i = 0; i < (length / 4); i++) {
+    word[i] = ((word[i] & 0x00FF00FF) << 8) | ((word[i] >> 8) & 0x00FF00FF);
+  }
+}
+
+
+/*
+ *  ======== putAckBlock ========
+ *  Put the command acknowledgement block into a frame.  Returns its length.
+ */
+uint32_t putAckBlock(uint8_t *out) {
+
+  const commandAck_t *ack;
+  uint32_t count, i;
+
+  count = (commandAckCount < ACK_BLOCK_ENTRIES) ? commandAckCount : ACK_BLOCK_ENTRIES;
+
+  bzero(out, ACK_BLOCK_SIZE);
+  out[0] = count;
+  out[1] = spiLinkStats.commandsDropped & 0xFF;
+
+  for (i = 0; i < count; i++) {
+    ack = &commandAck[(commandAckCount - 1 - i) & (COMMAND_ACKS - 1)];
+    out[2 + (i * ACK_BLOCK_ENTRY_SIZE)] = ack->seq;
+    out[3 + (i * ACK_BLOCK_ENTRY_SIZE)] = ack->status;
+    out[4 + (i * ACK_BLOCK_ENTRY_SIZE)] = (ack->data >> 8) & 0xFF;
+    out[5 + (i * ACK_BLOCK_ENTRY_SIZE)] = (ack->data     ) & 0xFF;
+  }
+
+  return ACK_BLOCK_SIZE;
+}
+
+
+/*
+ *  ======== ackCommand ========
+ *  Add a command result to the acknowledgement block.
+ */
+void ackCommand(uint8_t seq, commandStatus status, uint16_t data) {
+
+  commandAck_t *ack = &commandAck[commandAckCount & (COMMAND_ACKS - 1)];
+
+  ack->seq    = seq;
+  ack->status = status;
+  ack->data   = data;
+  commandAckCount++;
+}
+
+
+/*
+ *  ======== composeTxBuf ========
+ *  Compose the next frame into one of the transmit buffers, with its CRC if they are enabled.
+ */
+void composeTxBuf(uint8_t index) {
+
+  uint8_t *out = spiTxBuf[index];
+  uint32_t frameLength, length;
+  uint16_t crc;
+
+  spiTxDataCount[index] = dataReadyCount;
+  frameLength = composeFrame(out);
+  length = frameLength;
+
+  if (spiAckBlock) {
+    length += putAckBlock(&out[length]);
+  }
+
+  if (spiFrameLayout != flLegacy) {
+    while (length & 3) {
+      out[length++] = 0;
+    }
+  }
+
+  spiTxCrc[index] = spiCrcEnabled;
+  if (spiCrcEnabled) {
+
+    // The legacy sensor data frame keeps its CRC up to date as it goes
+    if ((spiFrameType == ftSensorData) && (spiFrameProfile == fpFull) &&
+        (spiSensorMask == SENSOR_MASK_ALL) && (spiFrameLayout == flLegacy)) {
+      crc = sensorFrameCrc;
+    } else {
+      crc = crc16(CRC16_INIT, out, frameLength);
+    }
+    crc = crc16(crc, &out[frameLength], length - frameLength);
+
+    out[length++] = (crc >> 8) & 0xFF;
+    out[length++] = (crc     ) & 0xFF;
+
+    if (spiFrameLayout != flLegacy) {
+      out[length++] = 0;
+      out[length++] = 0;
+    }
+  }
+
+  if (spiWide) {
+    swapBytePairs(out, length);
+    length /= 2;
+  }
+
+  spiTxCount[index] = length;
+}
+
+
+/*
+ *  ======== composeFrame ========
+ *  Compose the selected outgoing frame type into a transmit buffer.  Returns the length of the
+ *  frame, which is SPI_MESSAGE_LENGTH for all but the compact and aligned sensor data frames.
+ */
+uint32_t composeFrame(uint8_t *out) {
+
+  if (spiFrameType == ftEventLog) {
+    composeEventFrame();
+    memcpy(out, spiEventFrame, SPI_MESSAGE_LENGTH);
+  } else if (spiFrameType == ftDiagnostics) {
+    composeDiagFrame();
+    memcpy(out, spiDiagFrame, SPI_MESSAGE_LENGTH);
+  } else if (spiFrameType == ftSampleStream) {
+    composeStreamFrame();
+    memcpy(out, spiStreamFrame, SPI_MESSAGE_LENGTH);
+  } else if (spiFrameType == ftResources) {
+    composeResFrame();
+    memcpy(out, spiResFrame, SPI_MESSAGE_LENGTH);
+  } else if (spiFrameType == ftDeltaStream) {
+    composeDeltaFrame();
+    memcpy(out, spiDeltaFrame, SPI_MESSAGE_LENGTH);
+  } else {
+    composeSensorFrame();
+    if ((spiFrameProfile != fpFull) || (spiSensorMask != SENSOR_MASK_ALL)) {
+      return composeCompactFrame(out);
+    }
+    if (spiFrameLayout != flLegacy) {
+      return composeAlignedFrame(out);
+    }
+    memcpy(out, spiMessageOut.buf, SPI_MESSAGE_LENGTH);
+  }
+
+  return SPI_MESSAGE_LENGTH;
+}
+
+
+/*
+ * List of command, first byte should be 1
+ * - 110 use all old switch
+ * - 111X use particular switch (0 = all new [for legacy compatibility], else bit position indicates on/off values)
+ * - 12X retrieve differential capacitance only
+ * - 13X retrieve diff plus both single capacitances
+ * - 14X select the outgoing frame type (0 = sensor data, 1 = event log, 2 = diagnostics,
+ *   3 = sample stream, 4 = resources, 5 = delta coded sample stream)
+ * - 15PM select the sensor data frame profile P (0 = full, 1 = diff only, 2 = diagnostic) and the
+ *   sensors to put in it, a bit per sensor in M (0 = all)
+ * - 16X frame CRCs off (0) or on (1)
+ * - 17X select the frame layout (0 = legacy, 1 = word aligned, 2 = word aligned with 16 bit SSI
+ *   data frames)
+ * - 18X command acknowledgement block off (0) or on (1)
+ * First byte 3 is a register operation, see queueRegOp:
+ * - 3SRV, S: sensor << 4 | regChip << 1 | 1 to write, R: register, V: value to write
+ * Returns the result for the acknowledgement block.
+ */
+commandStatus slaveTaskCommand(const spiCommand_t *cmd) {
+
+  bool switchToNew, switchAllToOld, switchAllToNew, getDiffOnly, getAllCaps, selectFrame;
+  bool selectProfile, selectCrc, selectLayout, selectAcks;
+  uint8_t diffDevice;
+  int i;
+
+  if (cmd->cmd0 == 3) {
+    return queueRegOp(cmd);
+  }
+
+  switchAllToOld  = (cmd->cmd0 == 1) && (cmd->cmd1 == 1) && (cmd->cmd2 == 0);
+  switchToNew     = (cmd->cmd0 == 1) && (cmd->cmd1 == 1) && (cmd->cmd2 == 1);
+  getDiffOnly     = (cmd->cmd0 == 1) && (cmd->cmd1 == 2);
+  getAllCaps      = (cmd->cmd0 == 1) && (cmd->cmd1 == 3);
+  selectFrame     = (cmd->cmd0 == 1) && (cmd->cmd1 == 4) && (cmd->cmd2 <= ftDeltaStream);
+  selectProfile   = (cmd->cmd0 == 1) && (cmd->cmd1 == 5) && (cmd->cmd2 <= fpDiagnostic);
+  selectCrc       = (cmd->cmd0 == 1) && (cmd->cmd1 == 6) && (cmd->cmd2 <= 1);
+  selectLayout    = (cmd->cmd0 == 1) && (cmd->cmd1 == 7) && (cmd->cmd2 <= flAligned16);
+  selectAcks      = (cmd->cmd0 == 1) && (cmd->cmd1 == 8) && (cmd->cmd2 <= 1);
+
+  // When setting differential vs diff+C1+C2, the device number is in cmd2
+  diffDevice = cmd->cmd2;
+  if (diffDevice >= MAX_SENSORS)
+    diffDevice = 0;
+
+  /* Process the commands */
+  if (switchToNew) {
+
+    // By convention, 0x00 and 0xFF both equal "set all to new ACS"
+    switchAllToNew = (cmd->cmd3 == 0);
+
+    // New switch value, a bit per sensor; cmd3 only has room for the first 8
+    for (i = 0; i < MAX_SENSORS; i++) {
+      switchNew[i] = (switchAllToNew || ((i < 8) && (cmd->cmd3 & (1 << i)))) ? swNewACS : swOldACS;
+    }
+
+    // Start a new group switch, then set the flags to indicate all the values are getting updated
+    relayGroupStart((1 << MAX_SENSORS) - 1);
+    for (i = 0; i < MAX_SENSORS; i++) {
+      switchcmd[i] = true;
+    }
+
+    // Have the executive pick the command up straight away, so a sensor waiting to retry reports
+    // that it can't switch without waiting for its retry timer
+    Event_post(Event_handle(&execEvent), EXEC_EVENT_SENSORS);
+
+  } else if (switchAllToOld) {
+
+    for (i = 0; i < MAX_SENSORS; i++) {
+      switchNew[i] = swOldACS;
+    }
+
+    // Start a new group switch, then set the flags to indicate all the values are getting updated
+    relayGroupStart((1 << MAX_SENSORS) - 1);
+    for (i = 0; i < MAX_SENSORS; i++) {
+      switchcmd[i] = true;
+    }
+
+    // Have the executive pick the command up straight away, so a sensor waiting to retry reports
+    // that it can't switch without waiting for its retry timer
+    Event_post(Event_handle(&execEvent), EXEC_EVENT_SENSORS);
+
+  } else if (getDiffOnly) {
+
+    adGetAllCaps[diffDevice] = false;
+
+  } else if (getAllCaps) {
+
+    adGetAllCaps[diffDevice] = true;
+
+  } else if (selectFrame) {
+
+    spiFrameType = (frameType) cmd->cmd2;
+    if (spiFrameType == ftDeltaStream) {
+      deltaStreamReset();
+    }
+
+  } else if (selectProfile) {
+
+    spiFrameProfile = (frameProfile) cmd->cmd2;
+    spiSensorMask   = cmd->cmd3 & SENSOR_MASK_ALL;
+    if (spiSensorMask == 0) {
+      spiSensorMask = SENSOR_MASK_ALL;
+    }
+
+  } else if (selectCrc) {
+
+    spiCrcEnabled = (cmd->cmd2 == 1);
+
+  } else if (selectLayout) {
+
+    spiFrameLayout = (frameLayout) cmd->cmd2;
+
+  } else if (selectAcks) {
+
+    spiAckBlock = (cmd->cmd2 == 1);
+
+  } else {
+
+    logEvent(evBadCommand, EVENT_NO_DEVICE,
+             (cmd->cmd0 << 8) | cmd->cmd1,
+             (cmd->cmd2 << 8) | cmd->cmd3, 0);
+    return csUnknown;
+  }
+
+  return csDone;
+
+}
+
+
+/*
+ *  ======== queueRegOp ========
+ *  Queue a register operation (3SRV) for the executive.  Returns csQueued, or why it was not.
+ */
+commandStatus queueRegOp(const spiCommand_t *cmd) {
+
+  uint8_t device = cmd->cmd1 >> 4;
+  regOp_t *op;
+
+  if ((device >= MAX_SENSORS) || (((cmd->cmd1 >> 1) & 0x07) > rcSi7020)) {
+    return csUnknown;
+  }
+
+  if ((sensorDiag[device].state != tsRunning) ||
+      ((regOpHead[device] - regOpTail[device]) >= REG_OP_QUEUE)) {
+    return csRefused;
+  }
+
+  op = &regOpQueue[device][regOpHead[device] & (REG_OP_QUEUE - 1)];
+  op->seq   = cmd->seq;
+  op->chip  = (cmd->cmd1 >> 1) & 0x07;
+  op->reg   = cmd->cmd2;
+  op->value = cmd->cmd3;
+  op->write = cmd->cmd1 & 0x01;
+  regOpHead[device]++;
+
+  return csQueued;
+}
+
+
+/*
+ *  ======== regOpStep ========
+ *  Carry out up to REG_OPS_PER_GAP of the register operations queued for a sensor, between two
+ *  of its conversions.  The temperature/humidity sensor is left alone while it is measuring.
+ */
+void regOpStep(taskParams *p) {
+
+  regOp_t *op;
+  uint16_t data;
+  int n;
+
+  for (n = 0; (n < REG_OPS_PER_GAP) && (regOpTail[p->device] != regOpHead[p->device]); n++) {
+
+    op = &regOpQueue[p->device][regOpTail[p->device] & (REG_OP_QUEUE - 1)];
+
+    if (p->humpending && ((op->chip == rcHDC1080) || (op->chip == rcSi7020))) {
+      break;
+    }
+
+    data = 0;
+    regOpResult(op->seq, runRegOp(p, op, &data), data);
+    regOpTail[p->device]++;
+  }
+}
+
+
+/*
+ *  ======== runRegOp ========
+ *  Carry out one register operation.  Returns its result, with the value read in 'data'.
+ */
+commandStatus runRegOp(taskParams *p, const regOp_t *op, uint16_t *data) {
+
+  I2C_Transaction i2cTransaction = p->trans;
+  uint8_t txBuffer[3];
+  uint8_t rxBuffer[2];
+  uint8_t shadow;
+
+  // AD7746 writes to the shadowed registers keep the shadow, and the tuning, in step
+  if ((op->chip == rcAD7746) && op->write &&
+      (op->reg >= AD7746_SHADOW_FIRST) && (op->reg < (AD7746_SHADOW_FIRST + AD7746_SHADOW_COUNT))) {
+
+    shadow = AD7746_SHADOW_BIT(op->reg);
+    if (!(shadow & AD7746_TUNABLE)) {
+      return csRefused;
+    }
+
+    ad7746Tune[p->device].reg[op->reg - AD7746_SHADOW_FIRST] = op->value;
+    ad7746Tune[p->device].mask |= shadow;
+
+    setAD7746register(p->device, op->reg, op->value);
+    return (writeAD7746registers(p->handle, i2cTransaction, p->device, 7) == 0) ? csDone : csFailed;
+  }
+
+  if ((op->chip == rcPCA9536) && op->write && (op->reg == PCA9536_OUT_PORT_REG)) {
+    return csRefused;
+  }
+
+  switch (op->chip) {
+    case rcAD7746:  i2cTransaction.slaveAddress = AD7746_ADDR;  break;
+    case rcPCA9536: i2cTransaction.slaveAddress = PCA9536_ADDR; break;
+    case rcHDC1080: i2cTransaction.slaveAddress = HDC1080_ADDR; break;
+    default:        i2cTransaction.slaveAddress = Si7020_ADDR;  break;
+  }
+
+  txBuffer[0] = op->reg;
+  txBuffer[1] = op->value;
+  txBuffer[2] = 0;
+
+  i2cTransaction.writeBuf   = txBuffer;
+  i2cTransaction.writeCount = op->write ? ((op->chip == rcHDC1080) ? 3 : 2) : 1;
+  i2cTransaction.readBuf    = rxBuffer;
+  i2cTransaction.readCount  = op->write ? 0 : ((op->chip == rcHDC1080) ? 2 : 1);
+
+  if (!transferI2C(p->handle, &i2cTransaction, p->device)) {
+    logEvent(evRegisterOpFail, p->device, (op->chip << 8) | op->reg, (op->write << 8) | op->value, 0);
+    return csFailed;
+  }
+
+  if (!op->write) {
+    *data = (op->chip == rcHDC1080) ? ((rxBuffer[0] << 8) | rxBuffer[1]) : rxBuffer[0];
+  }
+
+  return csDone;
+}
+
+
+/*
+ *  ======== regOpResult ========
+ *  Hand the result of a register operation to the slave task.  If it has fallen that far behind,
+ *  the oldest result is overwritten.
+ */
+void regOpResult(uint8_t seq, commandStatus status, uint16_t data) {
+
+  regResult_t *res;
+  UInt key;
+
+  key = Hwi_disable();
+
+  if ((regResultHead - regResultTail) >= REG_RESULT_QUEUE) {
+    regResultTail++;
+  }
+
+  res = &regResultQueue[regResultHead & (REG_RESULT_QUEUE - 1)];
+  res->seq    = seq;
+  res->status = status;
+  res->data   = data;
+  regResultHead++;
+
+  Hwi_restore(key);
+}
+
+
+/*
+ *  ======== readRegResult ========
+ *  Take the oldest register operation result off the queue.  Returns false if it is empty.
+ */
+bool readRegResult(regResult_t *res) {
+
+  UInt key;
+  bool found = false;
+
+  key = Hwi_disable();
+
+  if (regResultTail != regResultHead) {
+    *res = regResultQueue[regResultTail & (REG_RESULT_QUEUE - 1)];
+    regResultTail++;
+    found = true;
+  }
+
+  Hwi_restore(key);
+
+  return found;
+}
+
+
+/*
+ *  ======== relayGroupStart ========
+ *  Begin a new group relay switch on the given sensors, called before their switch flags are set.
+ */
+void relayGroupStart(uint32_t targets) {
+
+  UInt key;
+
+  key = Hwi_disable();
+
+  relayGroup.seq++;
+  if (relayGroup.seq == 0) relayGroup.seq = 1;
+
+  relayGroup.targets  = targets;
+  relayGroup.done     = 0;
+  relayGroup.failed   = 0;
+  relayGroup.deadline = Clock_getTicks() + RELAY_GROUP_TIMEOUT_MS;
+  relayGroup.status   = rgBusy;
+
+  Hwi_restore(key);
+}
+
+
+/*
+ *  ======== relayGroupUpdate ========
+ *  Work out the status of the group relay switch from the per-sensor results, and log it the
+ *  first time it finishes.
+ */
+void relayGroupUpdate(void) {
+
+  UInt key;
+  uint32_t bit;
+  bool finished = false;
+  int i;
+
+  key = Hwi_disable();
+
+  if (relayGroup.status == rgBusy) {
+
+    relayGroup.done   = 0;
+    relayGroup.failed = 0;
+
+    for (i = 0; i < MAX_SENSORS; i++) {
+      bit = 1 << i;
+      if ((relayGroup.targets & bit) && (relayResult[i].seq == relayGroup.seq)) {
+        if (relayResult[i].ok) {
+          relayGroup.done |= bit;
+        } else {
+          relayGroup.failed |= bit;
+        }
+      }
+    }
+
+    if ((relayGroup.done | relayGroup.failed) == relayGroup.targets) {
+      relayGroup.status = (relayGroup.failed == 0) ? rgComplete : rgFailed;
+      finished = true;
+
+    } else if (TIME_REACHED(Clock_getTicks(), relayGroup.deadline)) {
+      relayGroup.status = rgTimeout;
+      finished = true;
+    }
+  }
+
+  Hwi_restore(key);
+
+  if (finished) {
+    logEvent(evRelayGroupDone, EVENT_NO_DEVICE, relayGroup.seq, relayGroup.status,
+             ((relayGroup.done & 0xFF) << 8) | (relayGroup.failed & 0xFF));
+  }
+}
+
+
+/*
+ *  ======== relayStart ========
+ *  Pick up a relay switch command for this sensor.  Only a running sensor can switch; any
+ *  other reports the switch failed straight away so the group does not wait for it.
+ */
+void relayStart(taskParams *p) {
+
+  *p->switchcmd = false;
+  p->relayseq   = relayGroup.seq;
+
+  if (p->state != tsRunning) {
+    relayReport(p, false);
+    return;
+  }
+
+  p->relay     = rsDelay;
+  p->relaytime = Clock_getTicks() + RELAY_DELAY_MS;
+  p->relaypos  = *p->switchnew;
+  p->relayok   = true;
+  sensorDiag[p->device].relayMoving = true;
+}
+
+
+/*
+ *  ======== relayReport ========
+ *  Report the result of this sensor's part of the group relay switch.
+ */
+void relayReport(taskParams *p, bool ok) {
+
+  relayResult[p->device].ok  = ok;
+  relayResult[p->device].seq = p->relayseq;
+
+  relayGroupUpdate();
+}
+
+
+/*
+ *  ======== relayStep ========
+ *  Advance the relay switch sequence once its current step is due.  Called between conversions
+ *  only, so the PCA9536 traffic stays off the bus during a capacitance acquisition.
+ */
+void relayStep(taskParams *p) {
+
+  uint32_t now = Clock_getTicks();
+
+  if ((p->relay == rsIdle) || !TIME_REACHED(now, p->relaytime)) {
+    return;
+  }
+
+  p->relayduringconv = true;
+
+  switch (p->relay) {
+
+    case rsDelay:
+      // Drive the relay and read the output back; if that fails there is nothing to hold, but
+      // still release the output
+      if ((switchPCA9536(p->handle, p->trans, p->device, p->relaypos) == -1) ||
+          (verifyPCA9536(p->handle, p->trans, p->device, relayPosition[p->device]) == -1)) {
+        p->relayok   = false;
+        p->relaytime = now;
+      } else {
+        p->relaytime = now + RELAY_HOLD_MS;
+      }
+      p->relay = rsHold;
+      break;
+
+    case rsHold:
+      if ((releasePCA9536(p->handle, p->trans, p->device) == -1) ||
+          (verifyPCA9536(p->handle, p->trans, p->device, PCA9536_OUT_PORT_RESET) == -1)) {
+        p->relayok = false;
+      }
+      p->relaytime = now + RELAY_SETTLE_MS;
+      p->relay = rsSettle;
+      break;
+
+    case rsSettle:
+    default:
+      p->relay = rsIdle;
+      relayReport(p, p->relayok);
+      break;
+  }
+
+  sensorDiag[p->device].relayMoving = (p->relay != rsIdle);
+}
+
+
+/*
+ *  ======== runFault ========
+ *  A running sensor has failed a read, a trigger or a check.  Go to tsRecover, which escalates
+ *  to the next recovery tier, or to 'tiermin' if the fault needs at least that.
+ */
+void runFault(taskParams *p, recoveryTier tiermin) {
+
+  if (p->tier == rtRetry && p->state != tsRecover) {
+    p->faulttime = Clock_getTicks();
+  }
+
+  if (tiermin > p->tiermin) {
+    p->tiermin = tiermin;
+  }
+
+  p->state = tsRecover;
+}
+
+
+/*
+ *  ======== restartConversion ========
+ *  Start a new conversion of the current capacitor, picking up the normal running sequence
+ *  when it completes.
+ */
+int restartConversion(taskParams *p) {
+
+  *p->intflag = 0;
+  enableConvInt(p);
+
+  p->convdeadline = Clock_getTicks() + MAX_SENSOR_TIMEOUT_MS;
+
+  return triggerAD7746capacitance(p->handle, p->trans, adAllSensorConversionTime, p->cap, p->device);
+}
+
+
+/*
+ *  ======== enableConvInt ========
+ *  Clear and enable the conversion complete interrupt, for a sensor that has one.
+ */
+void enableConvInt(taskParams *p) {
+
+  if (p->intline != SENSOR_NO_INTLINE) {
+    GPIO_clearInt(p->intline);
+    GPIO_enableInt(p->intline);
+  }
+}
+
+
+/*
+ *  ======== disableConvInt ========
+ *  Disable the conversion complete interrupt, for a sensor that has one.
+ */
+void disableConvInt(taskParams *p) {
+
+  if (p->intline != SENSOR_NO_INTLINE) {
+    GPIO_disableInt(p->intline);
+  }
+}
+
+
+/*
+ *  ======== startRetryTimer ========
+ *  Have the executive run the sensor again in 'ms', for waitRetryTimer to pick up.
+ */
+void startRetryTimer(taskParams *p, uint32_t ms) {
+
+  p->retryat = Clock_getTicks() + ms;
+  p->wakeat  = p->retryat;
+}
+
+
+/*
+ *  ======== waitRetryTimer ========
+ *  Returns true once the retry timer has expired.  Until then, keeps the sensor's wake up time
+ *  at the expiry, so that a run for some other reason (an event) doesn't bring it forward.
+ */
+bool waitRetryTimer(taskParams *p) {
+
+  if (!TIME_REACHED(Clock_getTicks(), p->retryat)) {
+    p->wakeat = p->retryat;
+    return false;
+  }
+
+  return true;
+}
+
+
+/*
+ *  ======== humidityFailed ========
+ *  The temperature/humidity sensor stopped answering; hold its values in reset until it is set
+ *  up again.
+ */
+void humidityFailed(taskParams *p) {
+
+  p->hdc1080initialized = false;
+  sensorDiag[p->device].hdcOK = false;
+  logEvent(evHDC1080Disconnected, p->device, 0, 0, 0);
+
+  sensorSample[p->device].temp      = 0;
+  sensorSample[p->device].humidity  = 0;
+  sensorSample[p->device].flags    &= ~SAMPLE_HUM_VALID;
+
+  publishSensor(p->device);
+}
+
+
+/*
+ *  ======== probeSensor ========
+ *  Check whether the sensor board is there with the cheapest transfer that will tell: its address
+ *  and a one byte read from the relay driver, the first device init talks to.
+ */
+bool probeSensor(taskParams *p) {
+
+  uint8_t rxBuffer[1];
+
+  p->trans.slaveAddress = PCA9536_ADDR;
+  p->trans.writeBuf     = NULL;
+  p->trans.writeCount   = 0;
+  p->trans.readBuf      = rxBuffer;
+  p->trans.readCount    = 1;
+
+  return transferI2C(p->handle, &p->trans, p->device);
+}
+
+
+/*
+ *  ======== sensorStep ========
+ *  Run one pass of a sensor's state machine.  Called by the executive when something has
+ *  happened for the sensor (its conversion complete interrupt, a relay command) or its wake up
+ *  time has come.  Nothing in here waits, other than for I2C transfers: a state that has to wait
+ *  sets the wake up time and returns.
+ */
+void sensorStep(taskParams *p) {
+
+  uint32_t now = Clock_getTicks();
+  regOp_t *op;
+
+  /* Unless the state says otherwise, run again after MIN_TASK_SLEEP_MS */
+  p->wakeat = now + MIN_TASK_SLEEP_MS;
+
+  switch(p->state) {
+
+    // ------------------------------------------------
+    case tsPOR:
+
+#ifdef DEBUG_INTERRUPT
+      // Skip over all but device 0 when debugging
+      if (p->device != 0) {
+        bootDone(p->device, false);
+        break;
+      }
+#endif
+
+      logEvent(evSensorPOR, p->device, 0, 0, 0);
+
+      p->tier    = rtRetry;
+      p->tiermin = rtRetry;
+      p->backoff = 0;
+
+#ifdef I2C_BENCHMARK
+      if (p->device == 0) {
+        benchmarkI2C(p);
+      }
+#endif
+
+      openI2C(p);
+
+      /* Power on reset state; drop into init immediately, don't even need to break */
+      p->state = tsInit;
+
+
+    // ------------------------------------------------
+    case tsInit:
+    default:
+
+      /* Give the temperature/humidity sensor time to power up before setting it up below; wait
+       * on the retry timer rather than sleeping, which would hold up every sensor */
+      if (now < HUMIDITY_POWERUP_MS) {
+        startRetryTimer(p, HUMIDITY_POWERUP_MS - now);
+        break;
+      }
+
+      /* Setup ACS connection relay control device */
+      if (setupPCA9536(p->handle, p->trans, p->device) == -1) {
+
+#ifndef DEBUG_INTERRUPT
+        // Suppress these during debugging
+        logEvent(evInitFailPCA9536, p->device, 0, 0, 0);
+#endif
+
+        /* Skip to init failed state to wait for next init pass */
+        p->state = tsInitFailed;
+        break;
+      }
+
+      /* Setup the capacitance sensing */
+      if (setupAD7746(p->handle, p->trans, p->device) == -1) {
+        logEvent(evInitFailAD7746, p->device, 0, 0, 0);
+
+        /* Skip to init failed state to wait for next init pass */
+        p->state = tsInitFailed;
+        break;
+      }
+
+      /* Setup the temperature/humidity sensing */
+      if (setupHDC1080(p->handle, p->trans, p->device, true) == -1) {
+        p->hdc1080initialized = false;
+        sensorDiag[p->device].hdcOK = false;
+        logEvent(evInitFailHDC1080, p->device, 0, 0, 0);
+
+      } else {
+        p->hdc1080initialized = true;
+        sensorDiag[p->device].hdcOK = true;
+      }
+
+      /* Got this far, it's now safe to start the device messaging */
+      p->state = tsStart;
+
+      logEvent(evInitOK, p->device, 0, 0, 0);
+      break;
+
+
+    // ------------------------------------------------
+    case tsInitFailed:
+
+      /* Init failed, probably due to a disconnected sensor */
+      bootDone(p->device, false);
+
+      /* Probe for it on a backoff */
+      if (p->backoff < PROBE_BACKOFF_MIN_MS) {
+        p->backoff = PROBE_BACKOFF_MIN_MS;
+      }
+
+      startRetryTimer(p, p->backoff);
+      p->state = tsInitFailedWait;
+      break;
+
+
+    // ------------------------------------------------
+    case tsInitFailedWait:
+
+      /* Run early, only to report a relay command it can't carry out (see below) */
+      if (!waitRetryTimer(p)) {
+        break;
+      }
+
+      if (probeSensor(p)) {
+        /* Something answered, time to try init again */
+        p->state = tsInit;
+        sensorDiag[p->device].reinits++;
+
+      } else {
+        /* Still not there, back off further */
+        p->backoff *= 2;
+        if (p->backoff > PROBE_BACKOFF_MAX_MS) {
+          p->backoff = PROBE_BACKOFF_MAX_MS;
+        }
+
+        startRetryTimer(p, p->backoff);
+      }
+
+      break;
+
+
+    // ------------------------------------------------
+    case tsStart:
+
+      /* Trigger the first conversion; this also disables any continuous triggering that might
+       * cause the interrupts to fire repeatedly */
+      *p->intflag = 0;
+      p->cap = DEFAULT_CAPACITOR_SELECT; // adcsC2D1
+      p->cap_prev = p->cap;
+      triggerAD7746capacitance(p->handle, p->trans, adAllSensorConversionTime, p->cap, p->device);
+
+      /* Let any edge from the trigger pass before enabling the interrupt */
+      startRetryTimer(p, 5);
+      p->state = tsStartArm;
+      break;
+
+
+    // ------------------------------------------------
+    case tsStartArm:
+
+      if (!waitRetryTimer(p)) {
+        break;
+      }
+
+      /* Clear and enable the interrupt.  The shortest conversion is 11ms, so its completion still
+       * interrupts and starts the sequence. */
+      enableConvInt(p);
+
+      /* Ready for normal running */
+      p->tempdue = now + MIN_TEMP_READ_PERIOD_MS;
+      p->convdeadline = now + MAX_SENSOR_TIMEOUT_MS;
+      p->humpending = false;
+      p->relay = rsIdle;
+      p->relayduringconv = false;
+      p->shadowcheck = 0;
+      p->backoff = 0;
+      sensorDiag[p->device].relayMoving = false;
+      p->state = tsRunning;
+      break;
+
+
+    // ------------------------------------------------
+    case tsRunning:
+
+      // SPI has set a flag to switch the node box relay; start the switch sequence, which is
+      // stepped between conversions below so acquisition keeps running.  A new command waits
+      // until any switch in progress has finished.
+      if ((*p->switchcmd == true) && (p->relay == rsIdle)) {
+        relayStart(p);
+      }
+
+      // If the conversion doesn't complete by its deadline, something fell off the rails, start over.
+      if ((*p->intflag == 0) && TIME_REACHED(Clock_getTicks(), p->convdeadline)) {
+        sensorDiag[p->device].timeouts++;
+
+        logEvent(evConvTimeout, p->device, MAX_SENSOR_TIMEOUT_MS, 0, 0);
+
+        runFault(p, rtRetrigger);
+        break;
+      }
+
+      /* A conversion has completed and interrupted.  Clear it and read out the converted value */
+      if (*p->intflag == 1) {
+
+#ifdef DEBUG_INTERRUPT
+System_printf("Thread int flag 0\n"); System_flush();
+#endif
+
+        // Setup for the next cap while reading the current one
+        p->cap_prev = p->cap;
+
+        // If only getting differential cap, force it here
+        if (!adGetAllCaps[p->device]) {
+          p->cap = DEFAULT_CAPACITOR_SELECT;
+
+        } else switch (p->cap) {
+
+          // Loop around the 3 values infinitely
+          case adcsC2D1:
+          default:
+            p->cap = adcsC1D0;  // Get the C1 single next
+            break;
+
+          case adcsC1D0:
+            p->cap = adcsC2D0;  // Get the C2 single next
+            break;
+
+          case adcsC2D0:
+            p->cap = adcsC2D1;  // Get the differential next
+            break;
+        }
+
+#ifdef EXEC_BENCHMARK
+        benchmarkExec(p);
+#endif
+
+        // Clear interrupt flag now that we've handled it
+        *p->intflag = 0;
+        disableConvInt(p);
+
+        // Read back the converted value from the AD7746, this refers to the previous cap in the sequence
+        if (readAD7746(p->handle, p->trans, p->cap_prev, p->device) == -1) {
+          runFault(p, rtRetrigger);
+          logEvent(evReadFailAD7746, p->device, 0, 0, 0);
+
+          // Leave the device alone until tsRecover has dealt with it
+          break;
+
+        } else {
+          // Flag the sample if the relay was moving at any point during its conversion
+          sensorDiag[p->device].relaySample = p->relayduringconv || RELAY_MOVING(p->relay);
+          diagSample(p->device);
+
+          // A good sample ends any fault recovery
+          if (p->tier != rtRetry) {
+            logEvent(evRecovered, p->device, p->tier, Clock_getTicks() - p->faulttime, 0);
+            p->tier = rtRetry;
+          }
+        }
+
+#ifdef DEBUG_INTERRUPT
+System_printf("Thread read 0\n"); System_flush();
+#endif
+
+
+        // --------------------------------------------------------------------------------------
+        // Periodically read the humidity and temperature, but ONLY when the conversion is done.
+        // Do this in order to 'stay off the bus' during a capacitance acquisition.  We will pick up
+        // temperature and humidity after at least 1 second has passed, plus whatever time is left
+        // on the most recent cap conversion.  The measurement is started between one pair of
+        // conversions and collected between a later pair, rather than holding the bus (and
+        // every other sensor) while it runs.
+        if (p->humpending) {
+
+          if (TIME_REACHED(Clock_getTicks(), p->humdue)) {
+
+            p->humpending = false;
+
+            // Attempt to read temp/humidity; if it fails, hold the values in reset
+            //if (readHDC1080(p->handle, p->trans, p->device) == -1) {
+            if (readSi7020(p->handle, p->trans, p->device) == -1) {
+              humidityFailed(p);
+            } else {
+              sensorDiag[p->device].hdcOK = true;
+            }
+          }
+
+        } else if (TIME_REACHED(Clock_getTicks(), p->tempdue)) {
+
+          // Set the next read time
+          p->tempdue = Clock_getTicks() + MIN_TEMP_READ_PERIOD_MS;
+
+          /* Setup the temperature/humidity sensing, if a device needs it */
+          if (!p->hdc1080initialized) {
+
+            if (setupHDC1080(p->handle, p->trans, p->device, false) == 0) {
+              p->hdc1080initialized = true;
+              sensorDiag[p->device].hdcOK = true;
+              logEvent(evHDC1080Reconnected, p->device, 0, 0, 0);
+            }
+
+          } else if (startSi7020(p->handle, p->trans, p->device) == -1) {
+            humidityFailed(p);
+
+          } else {
+            p->humpending = true;
+            p->humdue     = Clock_getTicks() + Si7020_MEASURE_MS;
+          }
+        }
+        // End of temperature/humidity conversion code.
+        // --------------------------------------------------------------------------------------
+
+        // Step any relay switch in progress, also only between conversions
+        p->relayduringconv = RELAY_MOVING(p->relay);
+        relayStep(p);
+
+        // Carry out any register operations the master has queued for the sensor
+        regOpStep(p);
+
+        // Periodically check the AD7746 still holds its setup, it loses it silently if it resets
+        if (++p->shadowcheck >= AD7746_SHADOW_CHECK_INTERVAL) {
+          p->shadowcheck = 0;
+
+          // A device that has lost its setup needs it again; a failed readback is just a fault
+          switch (checkAD7746registers(p->handle, p->trans, p->device)) {
+            case -1:
+              runFault(p, rtRetrigger);
+              break;
+            case -2:
+              runFault(p, rtReconfigure);
+              break;
+          }
+
+          if (p->state == tsRecover) {
+            break;
+          }
+        }
+
+        // Setup interrupt for next conversion completion
+        enableConvInt(p);
+
+        // Trigger the next conversion
+        if (p->capreads++ == AD7746_CAP_VS_TEMP_TRIGGER_INTERVAL) {
+
+#ifdef DEBUG_INTERRUPT
+System_printf("Trigger temp 0\n"); System_flush();
+#endif
+
+          // Every Nth capacitance reading, trigger a temperature conversion instead
+          if (triggerAD7746temperature(p->handle, p->trans, p->device) == -1) {
+            runFault(p, rtRetrigger);
+            logEvent(evTriggerFailTemp, p->device, 0, 0, 0);
+
+            p->capreads = 0;
+          }
+
+        } else {
+
+#ifdef DEBUG_INTERRUPT
+System_printf("Trigger cap 0\n"); System_flush();
+#endif
+
+          // Normal case is to trigger capacitance reads over and over
+          if (triggerAD7746capacitance(p->handle, p->trans, adAllSensorConversionTime, p->cap, p->device) == -1) {
+            runFault(p, rtRetrigger);
+            logEvent(evTriggerFailCap, p->device, 0, 0, 0);
+          }
+
+        }
+
+        // The next conversion is now under way; nothing more to do until it completes, or for a
+        // sensor with no interrupt line, until its status is next due to be polled
+        p->convdeadline = Clock_getTicks() + MAX_SENSOR_TIMEOUT_MS;
+
+        if (p->state == tsRunning) {
+          p->wakeat = (p->intline == SENSOR_NO_INTLINE) ? Clock_getTicks() + SENSOR_POLL_MS : p->convdeadline;
+        }
+
+      } else if (p->intline == SENSOR_NO_INTLINE) {
+
+        /* No interrupt line; read the AD7746 status every SENSOR_POLL_MS until the conversion is
+         * done */
+        switch (pollAD7746(p->handle, p->trans, p->device)) {
+          case 1:
+            *p->intflag = 1;
+            p->wakeat = now;
+            break;
+          case -1:
+            runFault(p, rtRetrigger);
+            break;
+          default:
+            p->wakeat = now + SENSOR_POLL_MS;
+            break;
+        }
+
+      } else {
+
+        /* Nothing to do until the conversion completes (its interrupt posts the sensor's event)
+         * or its deadline passes */
+        p->wakeat = p->convdeadline;
+      }
+
+      break;
+
+
+    // ------------------------------------------------
+    case tsRecover:
+
+      /* Escalate one tier each time the fault recurs before a good sample */
+      if (p->tier < rtReinit) {
+        p->tier++;
+      }
+      if (p->tier < p->tiermin) {
+        p->tier = p->tiermin;
+      }
+      p->tiermin = rtRetry;
+
+      sensorDiag[p->device].recoveries[p->tier]++;
+      logEvent(evRecoveryTier, p->device, p->tier, Clock_getTicks() - p->faulttime, 0);
+
+      p->state = tsRunning;
+
+      switch (p->tier) {
+
+        case rtRetrigger:
+          if (restartConversion(p) == -1) {
+            runFault(p, rtRetrigger);
+          }
+          break;
+
+        case rtReconfigure:
+          if ((setupAD7746(p->handle, p->trans, p->device) == -1) || (restartConversion(p) == -1)) {
+            runFault(p, rtReinit);
+          }
+          break;
+
+        default:
+          p->state = tsRunFailed;
+          break;
+      }
+
+      break;
+
+
+    // ------------------------------------------------
+    case tsRunFailed:
+
+      /* Runtime failure, probably due to a disconnected sensor */
+
+      /* Abandon any relay switch in progress; init resets the relay driver outputs */
+      if (p->relay != rsIdle) {
+        p->relay = rsIdle;
+        sensorDiag[p->device].relayMoving = false;
+        relayReport(p, false);
+      }
+
+      /* Fail the register operations still queued, they would otherwise only be answered once the
+       * sensor is running again, if ever */
+      while (regOpTail[p->device] != regOpHead[p->device]) {
+        op = &regOpQueue[p->device][regOpTail[p->device] & (REG_OP_QUEUE - 1)];
+        regOpResult(op->seq, csFailed, 0);
+        regOpTail[p->device]++;
+      }
+
+      /* Hold the cap/temp/hum in reset */
+      bzero(&sensorSample[p->device], sizeof(sensorSample_t));
+
+      publishSensor(p->device);
+
+      /* Setup the wait for a while before re-init attempt */
+      startRetryTimer(p, MAX_FAILED_INIT_WAIT_MS);
+      p->state = tsRunFailedWait;
+      break;
+
+
+    // ------------------------------------------------
+    case tsRunFailedWait:
+
+      /* Sleep until the timer expires before we try to init again */
+      if (waitRetryTimer(p)) {
+        p->state = tsInit;
+        sensorDiag[p->device].reinits++;
+      }
+
+      break;
+  }
+
+  /* A transfer timed out and the bus was closed; clear it and re-open it.  If the sensor was
+   * running, tsRecover then picks up again with a fresh conversion. */
+  if (sensorBus[p->bus].stuck) {
+    recoverI2C(p);
+  }
+
+  /* Too many errors at 400kHz; reopen the bus at 100kHz.  Any transfer that failed has already
+   * sent the sensor through tsRunFailed if it needed to. */
+  if (sensorBus[p->bus].fallback && sensorBus[p->bus].fast) {
+    logEvent(evI2CSpeedFallback, p->device, sensorBus[p->bus].errWindowFailures,
+             sensorBus[p->bus].errWindowTransfers, 0);
+    openI2C(p);
+  }
+
+  /* Pick up a new handle and speed if another sensor on the bus has re-opened it */
+  p->handle = sensorBus[p->bus].handle;
+  sensorDiag[p->device].i2cFast = sensorBus[p->bus].fast;
+
+  /* A relay switch commanded while the sensor is not running can't be done, report it */
+  if ((*p->switchcmd == true) && (p->state != tsRunning)) {
+    relayStart(p);
+  }
+
+  /* Publish the state for the diagnostics frame */
+  sensorDiag[p->device].state = p->state;
+}
+
+
+
+/*
+ *  ======== sensorExecFxn ========
+ *  The acquisition executive: runs the state machines of all the sensors from one task.  It
+ *  sleeps until an event comes in for a sensor (see EXEC_EVENT_SENSOR) or the earliest wake up
+ *  time of any sensor, then runs every sensor that has an event or is due.  Task for this
+ *  function is created statically. See the project's .cfg file.
+ */
+void sensorExecFxn(UArg arg0, UArg arg1) {
+
+  taskParams *p;
+  uint32_t now, events, timeout;
+  int32_t wait;
+  int i;
+
+  for (i = 0; i < MAX_SENSORS; i++) {
+
+    p = &sensorState[i];
+    bzero(p, sizeof(*p));
+
+    p->device    = i;
+    p->bus       = sensorConfig[i].bus;
+    p->intline   = sensorConfig[i].intline;
+    p->intflag   = &intflag[i];
+    p->handle    = NULL;
+    p->switchcmd = &switchcmd[i];
+    p->switchnew = &switchNew[i];
+    p->relay     = rsIdle;
+    p->state     = tsPOR;
+    p->wakeat    = Clock_getTicks();
+  }
+
+  while (1) {
+
+    /* Sleep until the first sensor is due, or an event */
+    now = Clock_getTicks();
+    timeout = BIOS_WAIT_FOREVER;
+
+    for (i = 0; i < MAX_SENSORS; i++) {
+      wait = (int32_t) (sensorState[i].wakeat - now);
+      if (wait < 0) wait = 0;
+      if ((uint32_t) wait < timeout) timeout = wait;
+    }
+
+    events = Event_pend(Event_handle(&execEvent), Event_Id_NONE, EXEC_EVENT_SENSORS, timeout);
+
+    /* Run the sensors that have something to do */
+    now = Clock_getTicks();
+
+    for (i = 0; i < MAX_SENSORS; i++) {
+      p = &sensorState[i];
+      if ((events & EXEC_EVENT_SENSOR(i)) || TIME_REACHED(now, p->wakeat)) {
+        sensorStep(p);
+      }
+    }
+  }
+}
+
+
+
+/*
+ *  ======== setupAD7746 ========
+ *
+ */
+int setupAD7746(I2C_Handle i2c, I2C_Transaction i2cTransaction, uint8_t device)
+{
+  uint8_t txBuffer[2];
+  uint8_t rxBuffer[4];
+  uint8_t offsH, offsL, gainH, gainL;
+  int i;
 
-  // Configure CONVERSION TIME
+  // Configure CAPACITANCE MEASUREMENT, VOLTAGE/TEMPERATURE (enable internal temperature sensor),
+  // EXCITATION, CONVERSION TIME and CAPDACs (off), all in one burst.  The device state is unknown
+  // at this point so every register is written.
   // -----------------------------------------------
-  txBuffer[0] = AD7746_CFG_REG;
-  txBuffer[1] = adAllSensorConversionTime;
+  setAD7746register(device, AD7746_CAP_SETUP_REG, adcsC2D1);
+  setAD7746register(device, AD7746_VT_SETUP_REG,  AD7746_VT_SETUP_INT_TEMP);
+  setAD7746register(device, AD7746_EXC_SETUP_REG, AD7746_EXC_SET_A);
+  setAD7746register(device, AD7746_CFG_REG,       adAllSensorConversionTime);
+  setAD7746register(device, AD7746_CAPDAC_A_REG,  AD7746_CAPDAC_OFF);
+  setAD7746register(device, AD7746_CAPDAC_B_REG,  AD7746_CAPDAC_OFF);
+
+  // Then any registers tuned over SPI (see regOpStep)
+  for (i = 0; i < AD7746_SHADOW_COUNT; i++) {
+    if (ad7746Tune[device].mask & (1 << i)) {
+      setAD7746register(device, AD7746_SHADOW_FIRST + i, ad7746Tune[device].reg[i]);
+    }
+  }
+  ad7746Shadow[device].dirty = AD7746_SHADOW_ALL;
 
-  if (!I2C_transfer(i2c, &i2cTransaction)) {
-    System_printf("(%d) Error in setup of AD7746 (setting conversion time).\n", device);
-    System_flush();
+  if (writeAD7746registers(i2c, i2cTransaction, device, 1) == -1) {
     return -1;
   }
-  System_flush();
 
-  Task_sleep(100);
+  // Read the setup back rather than waiting and hoping it took
+  if (checkAD7746registers(i2c, i2cTransaction, device) != 0) {
+    return -1;
+  }
 
 
   // Read CAPACITATIVE OFFSET CALIBRATION/GAIN
@@ -1191,14 +4511,14 @@ int setupAD7746(I2C_Handle i2c, I2C_Transaction i2cTransaction, uint8_t device)
 
   /* Read AD7746 register starting at Cap Offset H, total of 4 bytes */
   txBuffer[0]                 = AD7746_CAP_OFFSET_H;
+  i2cTransaction.slaveAddress = AD7746_ADDR;
   i2cTransaction.writeBuf     = txBuffer;
   i2cTransaction.writeCount   = 1;
   i2cTransaction.readBuf      = rxBuffer;
   i2cTransaction.readCount    = 4;
 
-  if (!I2C_transfer(i2c, &i2cTransaction)) {
-    System_printf("(%d) Error in setup of AD7746 (reading calibration).\n", device);
-    System_flush();
+  if (!transferI2C(i2c, &i2cTransaction, device)) {
+    logEvent(evI2CFailAD7746, device, AD7746_CAP_OFFSET_H, 1, 0);
     return -1;
   }
 
@@ -1207,8 +4527,7 @@ int setupAD7746(I2C_Handle i2c, I2C_Transaction i2cTransaction, uint8_t device)
   gainH = rxBuffer[2];
   gainL = rxBuffer[3];
 
-  System_printf("(%d) Calibrations: offset H: %d, offset L: %d, gain H: %d, gain L: %d\n", device, offsH, offsL, gainH, gainL);
-  System_flush();
+  logEvent(evAD7746Calibration, device, (offsH << 8) | offsL, (gainH << 8) | gainL, 0);
 
   return 0;
 }
@@ -1221,37 +4540,14 @@ int setupAD7746(I2C_Handle i2c, I2C_Transaction i2cTransaction, uint8_t device)
  */
 int triggerAD7746capacitance(I2C_Handle i2c, I2C_Transaction i2cTransaction, adConversionTime convTim, adCapSelect cap, uint8_t device) {
 
-    uint8_t txBuffer[2];
-    uint8_t rxBuffer[4];
-
-    /* Common message setup fields */
-    i2cTransaction.slaveAddress = AD7746_ADDR;
-    i2cTransaction.writeBuf     = txBuffer;
-    i2cTransaction.writeCount   = 2;
-    i2cTransaction.readBuf      = rxBuffer;
-    i2cTransaction.readCount    = 0;
-
-    /* Build first message to device: set capacitor configuration */
-    txBuffer[0] = AD7746_CAP_SETUP_REG;
-    txBuffer[1] = cap;
-
-    if (!I2C_transfer(i2c, &i2cTransaction)) {
-      System_printf("(%d) Error in AD7746 trigger (cap selection) of AD7746.\n", device);
-      System_flush();
-      return -1;
-    }
-
-    /* Build second message to device: set conversion time and trigger conversion */
-    txBuffer[0] = AD7746_CFG_REG;
-    txBuffer[1] = convTim;
+    /* Set the capacitor configuration (only written if it changed) and the conversion time.  The
+     * configuration register is always written, since that is what triggers the conversion, and
+     * goes last in the burst so the capacitor selection is already in place. */
+    setAD7746register(device, AD7746_CAP_SETUP_REG, cap);
+    setAD7746register(device, AD7746_CFG_REG, convTim);
+    ad7746Shadow[device].dirty |= AD7746_SHADOW_BIT(AD7746_CFG_REG);
 
-    if (!I2C_transfer(i2c, &i2cTransaction)) {
-      System_printf("(%d) Error in AD7746 trigger (set conversion time) of AD7746.\n", device);
-      System_flush();
-      return(-1);
-    }
-
-    return 0;
+    return writeAD7746registers(i2c, i2cTransaction, device, 2);
 }
 
 
@@ -1261,42 +4557,179 @@ int triggerAD7746capacitance(I2C_Handle i2c, I2C_Transaction i2cTransaction, adC
  */
 int triggerAD7746temperature(I2C_Handle i2c, I2C_Transaction i2cTransaction, uint8_t device) {
 
-    uint8_t txBuffer[2];
-    uint8_t rxBuffer[4];
-
-    /* Common message setup fields */
-    i2cTransaction.slaveAddress = AD7746_ADDR;
-    i2cTransaction.writeBuf     = txBuffer;
-    i2cTransaction.writeCount   = 2;
-    i2cTransaction.readBuf      = rxBuffer;
-    i2cTransaction.readCount    = 0;
-
     //TODO: Probably don't need this since it gets enabled above?
     /* Build message to device, read the temperature */
     /*
     txBuffer[0] = AD7746_VT_SETUP_REG;
     txBuffer[1] = AD7746_VT_SETUP_INT_TEMP;
 
-    if (!I2C_transfer(i2c, &i2cTransaction)) {
+    if (!transferI2C(i2c, &i2cTransaction, device)) {
       System_printf("(%d) Error in AD7746 trigger (temperature enable) of AD7746.\n", device);
       System_flush();
       return -1;
     }
     */
 
-    /* Build message to device: set conversion time and trigger conversion */
-    txBuffer[0] = AD7746_CFG_REG;
-    txBuffer[1] = DEFAULT_TEMPERATURE_CONVERSION_TIME;
+    /* Set conversion time and trigger conversion */
+    setAD7746register(device, AD7746_CFG_REG, DEFAULT_TEMPERATURE_CONVERSION_TIME);
+    ad7746Shadow[device].dirty |= AD7746_SHADOW_BIT(AD7746_CFG_REG);
 
-    if (!I2C_transfer(i2c, &i2cTransaction)) {
-      System_printf("(%d) Error in AD7746 trigger (set temperature conversion time) of AD7746.\n", device);
-      System_flush();
-      return(-1);
-    }
+    return writeAD7746registers(i2c, i2cTransaction, device, 3);
+}
 
+/*
+ *  ======== setAD7746register ========
+ *  Set a register in the AD7746 shadow, marking it to be written if the value changed
+ *
+ */
+void setAD7746register(uint8_t device, uint8_t reg, uint8_t value) {
+
+  ad7746Shadow_t *sh = &ad7746Shadow[device];
+
+  if (sh->reg[reg - AD7746_SHADOW_FIRST] != value) {
+    sh->reg[reg - AD7746_SHADOW_FIRST] = value;
+    sh->dirty |= AD7746_SHADOW_BIT(reg);
+  }
+}
+
+
+/*
+ *  ======== writeAD7746registers ========
+ *  Write the changed registers in the AD7746 shadow in a single burst.  'op' identifies the
+ *  caller in the failure event (see evI2CFailAD7746).
+ *
+ */
+int writeAD7746registers(I2C_Handle i2c, I2C_Transaction i2cTransaction, uint8_t device, uint8_t op) {
+
+  ad7746Shadow_t *sh = &ad7746Shadow[device];
+  uint8_t txBuffer[1 + AD7746_SHADOW_COUNT];
+  uint8_t rxBuffer[1];
+  int first, last, i;
+
+  if (sh->dirty == 0) {
     return 0;
+  }
+
+  // Span from the first to the last changed register
+  for (first = 0; !(sh->dirty & (1 << first)); first++);
+  for (last = AD7746_SHADOW_COUNT - 1; !(sh->dirty & (1 << last)); last--);
+
+  txBuffer[0] = AD7746_SHADOW_FIRST + first;
+  for (i = first; i <= last; i++) {
+    txBuffer[1 + i - first] = sh->reg[i];
+  }
+
+  i2cTransaction.slaveAddress = AD7746_ADDR;
+  i2cTransaction.writeBuf     = txBuffer;
+  i2cTransaction.writeCount   = 2 + last - first;
+  i2cTransaction.readBuf      = rxBuffer;
+  i2cTransaction.readCount    = 0;
+
+  if (!transferI2C(i2c, &i2cTransaction, device)) {
+    logEvent(evI2CFailAD7746, device, AD7746_SHADOW_FIRST + first, op, 0);
+    return -1;
+  }
+
+  sh->dirty = 0;
+  return 0;
+}
+
+
+/*
+ *  ======== checkAD7746registers ========
+ *  Read the shadowed registers back from the AD7746 and compare them with the shadow.  Returns
+ *  -1 if the readback fails, or -2 on a mismatch, meaning the device has lost its setup (most
+ *  likely it reset).
+ *
+ */
+int checkAD7746registers(I2C_Handle i2c, I2C_Transaction i2cTransaction, uint8_t device) {
+
+  ad7746Shadow_t *sh = &ad7746Shadow[device];
+  uint8_t txBuffer[1];
+  uint8_t rxBuffer[AD7746_SHADOW_COUNT];
+  uint8_t expected, actual;
+  int i;
+
+  txBuffer[0]                 = AD7746_SHADOW_FIRST;
+  i2cTransaction.slaveAddress = AD7746_ADDR;
+  i2cTransaction.writeBuf     = txBuffer;
+  i2cTransaction.writeCount   = 1;
+  i2cTransaction.readBuf      = rxBuffer;
+  i2cTransaction.readCount    = AD7746_SHADOW_COUNT;
+
+  if (!transferI2C(i2c, &i2cTransaction, device)) {
+    logEvent(evI2CFailAD7746, device, AD7746_SHADOW_FIRST, 5, 0);
+    return -1;
+  }
+
+  for (i = 0; i < AD7746_SHADOW_COUNT; i++) {
+
+    expected = sh->reg[i];
+    actual   = rxBuffer[i];
+
+    // The conversion mode bits change on their own as conversions start and finish
+    if ((AD7746_SHADOW_FIRST + i) == AD7746_CFG_REG) {
+      expected &= ~AD7746_CFG_MODE_MASK;
+      actual   &= ~AD7746_CFG_MODE_MASK;
+    }
+
+    if (expected != actual) {
+      logEvent(evAD7746ShadowMismatch, device, AD7746_SHADOW_FIRST + i, expected, actual);
+      return -2;
+    }
+  }
+
+  return 0;
+}
+
+
+/*
+ *  ======== pollAD7746 ========
+ *  Read the AD7746 status, for a sensor with no interrupt line.  Returns 1 if the conversion has
+ *  finished, 0 if it is still running, or -1 if the read fails.
+ *
+ */
+int pollAD7746(I2C_Handle i2c, I2C_Transaction i2cTransaction, uint8_t device) {
+
+  uint8_t txBuffer[1];
+  uint8_t rxBuffer[1];
+
+  txBuffer[0]                 = AD7746_STATUS_REG;
+  i2cTransaction.slaveAddress = AD7746_ADDR;
+  i2cTransaction.writeBuf     = txBuffer;
+  i2cTransaction.writeCount   = 1;
+  i2cTransaction.readBuf      = rxBuffer;
+  i2cTransaction.readCount    = 1;
+
+  if (!transferI2C(i2c, &i2cTransaction, device)) {
+    logEvent(evI2CFailAD7746, device, AD7746_STATUS_REG, 6, 0);
+    return -1;
+  }
+
+  return (rxBuffer[0] & AD7746_STATUS_RDY) ? 0 : 1;
+}
+
+
+/*
+ *  ======== filterCap ========
+ *  Apply the FILTER_COEFF low pass filter to a capacitance reading and return the filtered value,
+ *  both in counts.  The filter is linear, so it runs on the counts rather than on the capacitance
+ *  in pF, but on their signed offset from 0pF: a float holding the raw counts, around 2^23, only
+ *  has whole counts, and the filter would never move for a step under about 75 counts.
+ */
+uint32_t filterCap(capFilter_t *f, uint32_t counts) {
+
+  // Apply filtering algorithm to the value and the previous values
+  f->c = (FILTER_COEFF * f->cprev) + ((1.0 - FILTER_COEFF) * (float) ((int32_t) counts - AD7746_ZERO_COUNTS));
+
+  // Drop the last values down to the 'previous' value position
+  f->cprev = f->c;
+
+  // Round to the nearest count and add the offset back
+  return AD7746_ZERO_COUNTS + (int32_t) ((f->c < 0) ? (f->c - 0.5) : (f->c + 0.5));
 }
 
+
 /*  ======== readAD7746 ========
  *  function to read AD7746 capacitance & temperature
  *
@@ -1305,8 +4738,8 @@ int readAD7746(I2C_Handle i2c, I2C_Transaction i2cTransaction, adCapSelect cap,
 
   uint8_t txBuffer[1];
   uint8_t rxBuffer[6];
-  uint32_t ci;
-  float cr,c;
+  uint32_t counts;
+  sensorSample_t *sample;
 
   /* Read Ad7746 */
   txBuffer[0] = AD7746_READ;
@@ -1316,66 +4749,49 @@ int readAD7746(I2C_Handle i2c, I2C_Transaction i2cTransaction, adCapSelect cap,
   i2cTransaction.readBuf      = rxBuffer;
   i2cTransaction.readCount    = 6; // 3 bytes for cap only, 6 for cap and temp (see spec page 14)
 
-  if (!I2C_transfer(i2c, &i2cTransaction)) {
-    System_printf("(%d) Error in reading AD7746.\n", device);
-    System_flush();
+  if (!transferI2C(i2c, &i2cTransaction, device)) {
+    logEvent(evI2CFailAD7746, device, AD7746_READ, 4, 0);
     return -1;
   }
 
-  /* Get access to resource */
-  Semaphore_pend(semHandle, BIOS_WAIT_FOREVER);
+  counts = (rxBuffer[0] << 16) | (rxBuffer[1] << 8) | rxBuffer[2];
+  sample = &sensorSample[device];
 
-  // Put the values into the buffer used to talk back up the SPI
+  streamSample(device, cap, counts);
+
+  // Update the sample, published to the SPI slave task below
   switch(cap) {
 
     // Differential capacitor value
     case adcsC2D1:
-      spiMessageOut.msg.sensor[device].diffCapHigh = rxBuffer[0];
-      spiMessageOut.msg.sensor[device].diffCapMid  = rxBuffer[1];
-      spiMessageOut.msg.sensor[device].diffCapLow  = rxBuffer[2];
-
-      // Calculate the capacitance as a float, for usage in the filtered value
-      cr = (float) ((rxBuffer[0] << 16) + (rxBuffer[1] << 8) + (rxBuffer[2]));
-      c  = -4.096 + (cr * 8.192 / (1 << 24));
-
-      // Apply filtering algorithm to the value and the previous values
-      filter[device].c = (FILTER_COEFF * filter[device].cprev) + ((1.0 - FILTER_COEFF) * c);
-
-      // Drop the last values down to the 'previous' value position
-      filter[device].cprev = filter[device].c;
+      sample->diffCap = counts;
+      sample->capTime = Clock_getTicks();
+      sample->flags  |= SAMPLE_DIFF_VALID;
 
-      // Reverse convert the floating point filtered capacitance back into 3 bytes of raw value
-      c  = (filter[device].c + 4.096) * (1 << 24) / 8.192;
-      ci = (uint32_t) c;
-
-      // Assign back to the messaging buffer
-      spiMessageOut.msg.sensor[device].filtCapHigh = (ci >> 16) & 0xFF;
-      spiMessageOut.msg.sensor[device].filtCapMid  = (ci >>  8) & 0xFF;
-      spiMessageOut.msg.sensor[device].filtCapLow  = (ci      ) & 0xFF;
+      sample->filtCap = filterCap(&filter[device], counts);
       break;
 
     // Single C1 value
     case adcsC1D0:
-      spiMessageOut.msg.sensor[device].c1High = rxBuffer[0];
-      spiMessageOut.msg.sensor[device].c1Mid  = rxBuffer[1];
-      spiMessageOut.msg.sensor[device].c1Low  = rxBuffer[2];
+      sample->c1     = counts;
+      sample->flags |= SAMPLE_C1_VALID;
       break;
 
     // Single C2 value:
     case adcsC2D0:
-      spiMessageOut.msg.sensor[device].c2High = rxBuffer[0];
-      spiMessageOut.msg.sensor[device].c2Mid  = rxBuffer[1];
-      spiMessageOut.msg.sensor[device].c2Low  = rxBuffer[2];
+      sample->c2     = counts;
+      sample->flags |= SAMPLE_C2_VALID;
       break;
   }
 
   // Put the temperature values in each time, even if they're stale
-  spiMessageOut.msg.sensor[device].chiptempHigh = rxBuffer[3];
-  spiMessageOut.msg.sensor[device].chiptempMid  = rxBuffer[4];
-  spiMessageOut.msg.sensor[device].chiptempLow  = rxBuffer[5];
+  sample->chipTemp = (rxBuffer[3] << 16) | (rxBuffer[4] << 8) | rxBuffer[5];
+
+  publishSensor(device);
 
-  /* Unlock resource */
-  Semaphore_post(semHandle);
+  if (!STREAM_FRAME_SELECTED()) {
+    dataReadyPost();
+  }
 
   return 0;
 }
@@ -1384,7 +4800,7 @@ int readAD7746(I2C_Handle i2c, I2C_Transaction i2cTransaction, adCapSelect cap,
 
 /*
  *  ======== setupHDC1080 ========
- *
+ *  The device must have had HUMIDITY_POWERUP_MS since power on, see tsInit.
  */
 int setupHDC1080(I2C_Handle i2c, I2C_Transaction i2cTransaction, uint8_t device, bool reportfail) {
 
@@ -1392,8 +4808,6 @@ int setupHDC1080(I2C_Handle i2c, I2C_Transaction i2cTransaction, uint8_t device,
   uint8_t rxBuffer[4];
 
   // Configure HDC1080
-  Task_sleep(100);
-
   txBuffer[0]                 = HDC1080_CFG_REG;
   txBuffer[1]                 = (HDC1080_CFG_MODE_T_AND_H >> 8) & 0xFF;
   txBuffer[2]                 = (HDC1080_CFG_MODE_T_AND_H     ) & 0xFF;
@@ -1403,18 +4817,15 @@ int setupHDC1080(I2C_Handle i2c, I2C_Transaction i2cTransaction, uint8_t device,
   i2cTransaction.readBuf      = rxBuffer;
   i2cTransaction.readCount    = 0;
 
-  if (!I2C_transfer(i2c, &i2cTransaction)) {
+  if (!transferI2C(i2c, &i2cTransaction, device)) {
     if (reportfail) {
-      System_printf("(%d) Error in setup of HDC1080, config failure.\n", device);
-      System_flush();
+      logEvent(evI2CFailHDC1080, device, HDC1080_CFG_REG, 1, 0);
     }
     return -1;
   }
 
 
   // Trigger first read
-  Task_sleep(100);
-
   txBuffer[0]                 = HDC1080_TRIGGER_BOTH;
   i2cTransaction.slaveAddress = HDC1080_ADDR;
   i2cTransaction.writeBuf     = txBuffer;
@@ -1422,9 +4833,8 @@ int setupHDC1080(I2C_Handle i2c, I2C_Transaction i2cTransaction, uint8_t device,
   i2cTransaction.readBuf      = rxBuffer;
   i2cTransaction.readCount    = 0;
 
-  if (!I2C_transfer(i2c, &i2cTransaction)) {
-    System_printf("(%d) Error in setup HDC1080, trigger failure.\n", device);
-    System_flush();
+  if (!transferI2C(i2c, &i2cTransaction, device)) {
+    logEvent(evI2CFailHDC1080, device, HDC1080_TRIGGER_BOTH, 1, 0);
     return -1;
   }
 
@@ -1441,7 +4851,6 @@ int readHDC1080 (I2C_Handle i2c, I2C_Transaction i2cTransaction, uint8_t device)
 
   uint8_t txBuffer[1];
   uint8_t rxBuffer[4];
-  float t, h;
 
   /* Read Si7020 HDC1080_TMP */
   txBuffer[0]                 = HDC1080_TMP_REG;
@@ -1451,28 +4860,21 @@ int readHDC1080 (I2C_Handle i2c, I2C_Transaction i2cTransaction, uint8_t device)
   i2cTransaction.readBuf      = rxBuffer;
   i2cTransaction.readCount    = 4;   // Read 4 bytes: temperature AND humidity in one transaction
 
-  if (!I2C_transfer(i2c, &i2cTransaction)) {
+  if (!transferI2C(i2c, &i2cTransaction, device)) {
     //System_printf("(%d) Error in reading HDC1080 device.\n", device);
     //System_flush();
     return -1;
   }
 
-  t = (float)((rxBuffer[0] << 8) + (rxBuffer[1]))/65536*165-40;
-  h = (float)((rxBuffer[2] << 8) + (rxBuffer[3]))*100/65536;
-  System_printf("(%d) temp = %f / humidity = %f\n", device, t, h);
-  System_flush();
-
+  //t = (float)((rxBuffer[0] << 8) + (rxBuffer[1]))/65536*165-40;
+  //h = (float)((rxBuffer[2] << 8) + (rxBuffer[3]))*100/65536;
 
-  /* Get access to resource */
-  Semaphore_pend(semHandle, BIOS_WAIT_FOREVER);
+  sensorSample[device].temp      = (rxBuffer[0] << 8) | rxBuffer[1];
+  sensorSample[device].humidity  = (rxBuffer[2] << 8) | rxBuffer[3];
+  sensorSample[device].humTime   = Clock_getTicks();
+  sensorSample[device].flags    |= SAMPLE_HUM_VALID;
 
-  spiMessageOut.msg.sensor[device].tempHigh     = rxBuffer[0];
-  spiMessageOut.msg.sensor[device].tempLow      = rxBuffer[1];
-  spiMessageOut.msg.sensor[device].humidityHigh = rxBuffer[2];
-  spiMessageOut.msg.sensor[device].humidityLow  = rxBuffer[3];
-
-  /* Unlock resource */
-  Semaphore_post(semHandle);
+  publishSensor(device);
 
 
   // Trigger next read
@@ -1484,9 +4886,8 @@ int readHDC1080 (I2C_Handle i2c, I2C_Transaction i2cTransaction, uint8_t device)
   i2cTransaction.readBuf      = rxBuffer;
   i2cTransaction.readCount    = 0;
 
-  if (!I2C_transfer(i2c, &i2cTransaction)) {
-    System_printf("(%d) Error in reading HDC1080, setup next trigger failure.\n", device);
-    System_flush();
+  if (!transferI2C(i2c, &i2cTransaction, device)) {
+    logEvent(evI2CFailHDC1080, device, HDC1080_TRIGGER_BOTH, 2, 0);
     return -1;
   }
 
@@ -1494,75 +4895,76 @@ int readHDC1080 (I2C_Handle i2c, I2C_Transaction i2cTransaction, uint8_t device)
 }
 
 /*
- *  ======== readSi7020 ========
- *  function to read Si7020 Si7020Temp & Si7020Hum
+ *  ======== startSi7020 ========
+ *  Start a Si7020 humidity measurement, which measures the temperature too.  No hold master
+ *  mode, so the bus is free while it runs; readSi7020 collects the result Si7020_MEASURE_MS later.
  *
  */
-// Si7020_A
-#define Si7020_ADDR          0x40
-#define Si7020_HUM_HOLD      0xE5
-#define Si7020_HUM_NO_HOLD   0xF5
-#define Si7020_TMP_HOLD      0xE3
-#define Si7020_TMP_NO_HOLD   0xF3
-#define Si7020_TMP_PREVIOUS  0xF0
-#define Si7020_RESET         0xFE
-#define Si7020_WRITE_USER_1  0xE6
-#define Si7020_WRITE_USER_2  0x51
-#define Si7020_READ_HEATER   0x11
+int startSi7020(I2C_Handle i2c, I2C_Transaction i2cTransaction, uint8_t device)
+{
+    uint8_t         txBuffer[1];
+
+    txBuffer[0]                 = Si7020_HUM_NO_HOLD;
+    i2cTransaction.slaveAddress = Si7020_ADDR;
+    i2cTransaction.writeBuf     = txBuffer;
+    i2cTransaction.writeCount   = 1;
+    i2cTransaction.readBuf      = NULL;
+    i2cTransaction.readCount    = 0;
+    if (!transferI2C(i2c, &i2cTransaction, device))
+    {
+    logEvent(evI2CFailSi7020, device, Si7020_HUM_NO_HOLD, 0, 0);
+    return -1;
+    }
+
+    return 0;
+}
 
+
+/*
+ *  ======== readSi7020 ========
+ *  function to read Si7020 Si7020Temp & Si7020Hum, from the measurement started by startSi7020
+ *
+ */
 int readSi7020 (I2C_Handle i2c, I2C_Transaction i2cTransaction, uint8_t device)
 {
     uint8_t         txBuffer[1];
     uint8_t         rxBuffer[2];
-    float t, h;
+    uint8_t         humidity[2];
 
-    /* Read Si7020 Si7020Temp */
-    txBuffer[0]                 = Si7020_TMP_HOLD;
+    /* Read Si7020 Si7020Hum; the device NACKs until the measurement is done */
     i2cTransaction.slaveAddress = Si7020_ADDR;
-    i2cTransaction.writeBuf     = txBuffer;
-    i2cTransaction.writeCount   = 1;
-    i2cTransaction.readBuf      = rxBuffer;
+    i2cTransaction.writeBuf     = NULL;
+    i2cTransaction.writeCount   = 0;
+    i2cTransaction.readBuf      = humidity;
     i2cTransaction.readCount    = 2;
-    if (!I2C_transfer(i2c, &i2cTransaction))
+    if (!transferI2C(i2c, &i2cTransaction, device))
     {
-    System_printf("readSi7020: Error 1\n");
-    System_flush();
+    logEvent(evI2CFailSi7020, device, Si7020_HUM_NO_HOLD, 0, 0);
     return -1;
     }
-    //Si7020Temp = (float)((rxBuffer[0] << 8) + (rxBuffer[1]))*175.2/65536-46.85;
-    t = (float)((rxBuffer[0] << 8) + (rxBuffer[1]))*175.72/65536-46.85;
-
-    spiMessageOut.msg.sensor[device].tempHigh     = rxBuffer[0];
-    spiMessageOut.msg.sensor[device].tempLow      = rxBuffer[1];
 
-    /* Read Si7020 Si7020Hum */
-    txBuffer[0]                 = Si7020_HUM_HOLD;
+    /* Read Si7020 Si7020Temp, as measured along with the humidity */
+    txBuffer[0]                 = Si7020_TMP_FROM_HUM;
     i2cTransaction.slaveAddress = Si7020_ADDR;
     i2cTransaction.writeBuf     = txBuffer;
     i2cTransaction.writeCount   = 1;
     i2cTransaction.readBuf      = rxBuffer;
     i2cTransaction.readCount    = 2;
-    if (!I2C_transfer(i2c, &i2cTransaction))
+    if (!transferI2C(i2c, &i2cTransaction, device))
     {
-    System_printf("readSi7020: Error 2\n");
-    System_flush();
+    logEvent(evI2CFailSi7020, device, Si7020_TMP_FROM_HUM, 0, 0);
     return -1;
     }
+    //Si7020Temp = (float)((rxBuffer[0] << 8) + (rxBuffer[1]))*175.72/65536-46.85;
 
-    //Si7020Hum = (float)((rxBuffer[0] << 8) + (rxBuffer[1]))*125/65536-6;
-    h = (float)((rxBuffer[0] << 8) + (rxBuffer[1]))*125/65536-6;
-    System_printf("(%d) temp = %f / humidity = %f\n", device, t, h);
-    System_flush();
-
-
-    /* Get access to resource */
-    Semaphore_pend(semHandle, BIOS_WAIT_FOREVER);
+    //Si7020Hum = (float)((humidity[0] << 8) + (humidity[1]))*125/65536-6;
 
-    spiMessageOut.msg.sensor[device].humidityHigh = rxBuffer[0];
-    spiMessageOut.msg.sensor[device].humidityLow  = rxBuffer[1];
+    sensorSample[device].temp      = (rxBuffer[0] << 8) | rxBuffer[1];
+    sensorSample[device].humidity  = (humidity[0] << 8) | humidity[1];
+    sensorSample[device].humTime   = Clock_getTicks();
+    sensorSample[device].flags    |= SAMPLE_HUM_VALID;
 
-    /* Unlock resource */
-    Semaphore_post(semHandle);
+    publishSensor(device);
 
 
     return 0;
@@ -1587,31 +4989,40 @@ int setupPCA9536(I2C_Handle i2c, I2C_Transaction i2cTransaction, uint8_t device)
 
   txBuffer[0] = PCA9536_OUT_PORT_REG;
   txBuffer[1] = PCA9536_OUT_PORT_RESET;
-  if (!I2C_transfer(i2c, &i2cTransaction)) {
+  if (!transferI2C(i2c, &i2cTransaction, device)) {
 #ifndef DEBUG_INTERRUPT
-    System_printf("(%d) Error in setup of PCA9536, initial reset of output ports.\n", device);
-    System_flush();
+    logEvent(evI2CFailPCA9536, device, PCA9536_OUT_PORT_REG, PCA9536_OUT_PORT_RESET, 0);
 #endif
     return -1;
   }
-  Task_sleep(100);
 
   txBuffer[0] = PCA9536_CONFIG_REG;
   txBuffer[1] = PCA9536_CONFIG_ALL_OUTPUT;
-  if (!I2C_transfer(i2c, &i2cTransaction)) {
-    System_printf("(%d) Error in setup of PCA9536, configure output ports.\n", device);
-    System_flush();
+  if (!transferI2C(i2c, &i2cTransaction, device)) {
+    logEvent(evI2CFailPCA9536, device, PCA9536_CONFIG_REG, PCA9536_CONFIG_ALL_OUTPUT, 0);
+    return -1;
+  }
+
+  // Read the configuration back (the upper 4 bits are unused and read as 1)
+  i2cTransaction.writeCount   = 1;
+  i2cTransaction.readCount    = 1;
+  if (!transferI2C(i2c, &i2cTransaction, device)) {
+    logEvent(evI2CFailPCA9536, device, PCA9536_CONFIG_REG, PCA9536_CONFIG_ALL_OUTPUT, 0);
+    return -1;
+  }
+
+  if ((rxBuffer[0] & PCA9536_OUT_PORT_MASK) != PCA9536_CONFIG_ALL_OUTPUT) {
+    logEvent(evPCA9536VerifyFail, device, PCA9536_CONFIG_REG, PCA9536_CONFIG_ALL_OUTPUT, rxBuffer[0]);
     return -1;
   }
-  Task_sleep(100);
 
 #ifdef ZERO
   // This code is disabled for now, to ensure the states of the relays don't change while working
   // with the Kona and LBL node boxes at summit (normally happens on a Tiva reset).  PMR 2019-04-22
 
   txBuffer[0] = PCA9536_OUT_PORT_REG;
-  txBuffer[1] = currentSwitchPosition;
-  if (!I2C_transfer(i2c, &i2cTransaction)) {
+  txBuffer[1] = relayPosition[device];
+  if (!transferI2C(i2c, &i2cTransaction, device)) {
     System_printf("(%d) Error in setup of PCA9536, set of output ports to new ACS.\n", device);
     System_flush();
     return -1;
@@ -1620,7 +5031,7 @@ int setupPCA9536(I2C_Handle i2c, I2C_Transaction i2cTransaction, uint8_t device)
 
   txBuffer[0] = PCA9536_OUT_PORT_REG;
   txBuffer[1] = PCA9536_OUT_PORT_RESET;
-  if (!I2C_transfer(i2c, &i2cTransaction))
+  if (!transferI2C(i2c, &i2cTransaction, device))
   {
     System_printf("(%d) Error in setup of PCA9536, final reset of output ports.\n", device);
     System_flush();
@@ -1635,7 +5046,8 @@ int setupPCA9536(I2C_Handle i2c, I2C_Transaction i2cTransaction, uint8_t device)
 
 /*
  *  ======== switchPCS936 ========
- *  Switch between OLD and NEW NB
+ *  Switch between OLD and NEW NB.  Drives the relay only; the output must be released with
+ *  releasePCA9536 once the relay has been held long enough.
  *
  */
 int switchPCA9536(I2C_Handle i2c, I2C_Transaction i2cTransaction, uint8_t device, swRelayPositions pos) {
@@ -1654,12 +5066,11 @@ int switchPCA9536(I2C_Handle i2c, I2C_Transaction i2cTransaction, uint8_t device
 
     txBuffer[0] = PCA9536_OUT_PORT_REG;
     txBuffer[1] = PCA9536_OUT_PORT_NEW_ACS;
-    if (!I2C_transfer(i2c, &i2cTransaction)) {
-      System_printf("(%d) Error in switching PCA9536, setting to new ACS.\n", device);
-      System_flush();
+    if (!transferI2C(i2c, &i2cTransaction, device)) {
+      logEvent(evI2CFailPCA9536, device, PCA9536_OUT_PORT_REG, PCA9536_OUT_PORT_NEW_ACS, 0);
       return -1;
     }
-    currentSwitchPosition = PCA9536_OUT_PORT_NEW_ACS;
+    relayPosition[device] = PCA9536_OUT_PORT_NEW_ACS;
     GPIO_write(Board_LED3, Board_LED_ON);
 
   /* Else default to old ACS position */
@@ -1667,23 +5078,71 @@ int switchPCA9536(I2C_Handle i2c, I2C_Transaction i2cTransaction, uint8_t device
 
     txBuffer[0] = PCA9536_OUT_PORT_REG;
     txBuffer[1] = PCA9536_OUT_PORT_OLD_ACS;
-    if (!I2C_transfer(i2c, &i2cTransaction)) {
-      System_printf("(%d) Error in switching PCA9536, setting to old ACS.\n", device);
-      System_flush();
+    if (!transferI2C(i2c, &i2cTransaction, device)) {
+      logEvent(evI2CFailPCA9536, device, PCA9536_OUT_PORT_REG, PCA9536_OUT_PORT_OLD_ACS, 0);
       return -1;
     }
-    currentSwitchPosition = PCA9536_OUT_PORT_OLD_ACS;
+    relayPosition[device] = PCA9536_OUT_PORT_OLD_ACS;
     GPIO_write(Board_LED3, Board_LED_OFF);
   }
 
-  /* Hold the relay state for 100ms before resetting the driver */
-  Task_sleep(100);
+  logEvent(evRelaySwitched, device, pos, 0, 0);
+
+  return 0;
+}
+
+
+/*
+ *  ======== releasePCA936 ========
+ *  Reset the outputs after the relay has been held (RELAY_HOLD_MS) by switchPCA9536
+ *
+ */
+int releasePCA9536(I2C_Handle i2c, I2C_Transaction i2cTransaction, uint8_t device) {
+
+  uint8_t txBuffer[2];
+  uint8_t rxBuffer[4];
+
+  i2cTransaction.slaveAddress = PCA9536_ADDR;
+  i2cTransaction.writeBuf     = txBuffer;
+  i2cTransaction.writeCount   = 2;
+  i2cTransaction.readBuf      = rxBuffer;
+  i2cTransaction.readCount    = 0;
 
   txBuffer[0] = PCA9536_OUT_PORT_REG;
   txBuffer[1] = PCA9536_OUT_PORT_RESET;
-  if (!I2C_transfer(i2c, &i2cTransaction)) {
-    System_printf("(%d) Error in switching PCA9536, final reset of output ports.\n", device);
-    System_flush();
+  if (!transferI2C(i2c, &i2cTransaction, device)) {
+    logEvent(evI2CFailPCA9536, device, PCA9536_OUT_PORT_REG, PCA9536_OUT_PORT_RESET, 0);
+    return -1;
+  }
+
+  return 0;
+}
+
+
+/*
+ *  ======== verifyPCA936 ========
+ *  Read back the output port register and check it holds the value last written
+ *
+ */
+int verifyPCA9536(I2C_Handle i2c, I2C_Transaction i2cTransaction, uint8_t device, uint8_t expected) {
+
+  uint8_t txBuffer[1];
+  uint8_t rxBuffer[1];
+
+  txBuffer[0]                 = PCA9536_OUT_PORT_REG;
+  i2cTransaction.slaveAddress = PCA9536_ADDR;
+  i2cTransaction.writeBuf     = txBuffer;
+  i2cTransaction.writeCount   = 1;
+  i2cTransaction.readBuf      = rxBuffer;
+  i2cTransaction.readCount    = 1;
+
+  if (!transferI2C(i2c, &i2cTransaction, device)) {
+    logEvent(evI2CFailPCA9536, device, PCA9536_OUT_PORT_REG, expected, 0);
+    return -1;
+  }
+
+  if ((rxBuffer[0] & PCA9536_OUT_PORT_MASK) != expected) {
+    logEvent(evRelayVerifyFail, device, expected, rxBuffer[0], 0);
     return -1;
   }
 
@@ -1695,24 +5154,68 @@ int switchPCA9536(I2C_Handle i2c, I2C_Transaction i2cTransaction, uint8_t device
  * NOTE:
  * -----
  * Because you can't use timing in the interrupt function, the interrupt is only changing a "flag".
- * This flag change is detected by the I2C task which can do all the timing and readout of the I2C
- * devices.  This flag is set back to 0 once the tasks are done.
+ * This flag change, and the event posted with it, is picked up by the acquisition executive which
+ * does all the timing and readout of the I2C devices.  The flag is set back to 0 once it is done.
  */
 
 /*
- *  ======== sensNcvtDoneItr ========
- *  Callback functions for the GPIO interrupts, set a flag for the task to see
+ *  ======== sensCvtDoneItr ========
+ *  Callback function for the GPIO interrupts, sets the flag for the sensor on that line and wakes
+ *  the executive
  */
-void sens0cvtDoneItr(uint32_t index) { intflag0 = true;
+void sensCvtDoneItr(uint32_t index) {
+
+  int i;
+
+  for (i = 0; i < MAX_SENSORS; i++) {
+    if (sensorConfig[i].intline == index) {
+#ifdef EXEC_BENCHMARK
+      execRdyTime[i] = Timestamp_get32();
+#endif
+      intflag[i] = true;
+      Event_post(Event_handle(&execEvent), EXEC_EVENT_SENSOR(i));
+
 #ifdef DEBUG_INTERRUPT
-System_printf("INT0\n");
+System_printf("INT%d\n", i);
 #endif
-} // PA7
-void sens1cvtDoneItr(uint32_t index) { intflag1 = true; } // PF4
-void sens2cvtDoneItr(uint32_t index) { intflag2 = true; } // D7
-void sens3cvtDoneItr(uint32_t index) { intflag3 = true; } // E0
-void sens4cvtDoneItr(uint32_t index) { intflag4 = true; } // B5
-void sens5cvtDoneItr(uint32_t index) { intflag5 = true; } // C4
+    }
+  }
+}
+
+
+/*
+ *  ======== checkSensorConfig ========
+ *  Check sensorConfig[] makes sense: every sensor on a real bus, and the sensors on a bus either
+ *  sharing one multiplexer on different channels or alone.
+ */
+void checkSensorConfig(void) {
+
+  const sensorConfig_t *a, *b;
+  int i, j;
+
+  for (i = 0; i < MAX_SENSORS; i++) {
+
+    a = &sensorConfig[i];
+
+    if ((a->bus >= SENSOR_BUSES) || ((a->mux != TCA9548_NONE) && (a->channel >= TCA9548_CHANNELS))) {
+      System_abort("Bad sensor configuration\n");
+    }
+
+    for (j = i + 1; j < MAX_SENSORS; j++) {
+
+      b = &sensorConfig[j];
+
+      if ((a->bus == b->bus) &&
+          ((a->mux == TCA9548_NONE) || (a->mux != b->mux) || (a->channel == b->channel))) {
+        System_abort("Sensors conflict on a shared bus\n");
+      }
+
+      if ((a->intline != SENSOR_NO_INTLINE) && (a->intline == b->intline)) {
+        System_abort("Sensors share an interrupt line\n");
+      }
+    }
+  }
+}
 
 
 
@@ -1723,20 +5226,20 @@ int main(void) {
 
   /* Construct BIOS objects */
   Semaphore_Params semParams;
+  Event_Params eventParams;
+  capFilter_t filterCheck = { 0, 0 };
+  uint32_t filtered = 0;
+  int i;
 
-  /* Construct a Semaphore object to be use as a resource lock, inital count 1 */
-  Semaphore_Params_init(&semParams);
-  Semaphore_construct(&semStruct, 1, &semParams);
-
-  /* Obtain instance handle */
-  semHandle = Semaphore_handle(&semStruct);
+  checkSensorConfig();
 
+  /* Sensor and transfer completion events for the acquisition executive */
+  Event_Params_init(&eventParams);
+  Event_construct(&execEvent, &eventParams);
 
-  /* Get access to resource */
-  Semaphore_pend(semHandle, BIOS_WAIT_FOREVER);
-
-  /* Unlock resource */
-  Semaphore_post(semHandle);
+  /* SPI transfer completion, counted so that the slave task sees every transfer */
+  Semaphore_Params_init(&semParams);
+  Semaphore_construct(&slaveSpiDoneStruct, 0, &semParams);
 
 
 
@@ -1749,8 +5252,25 @@ int main(void) {
   /* Zero out the SPI comm structure */
   bzero(spiMessageIn.buf, sizeof(spiMessageIn.buf));
   bzero(spiMessageOut.buf, sizeof(spiMessageOut.buf));
+  crcInit();
 
   bzero(adGetAllCaps, sizeof(adGetAllCaps));
+  bzero(sensorDiag, sizeof(sensorDiag));
+
+  // The capacitance filters start from 0pF, the middle of the AD7746 range.  Check that one follows
+  // a single count step from there within FILTER_SETTLE_SAMPLES readings.
+  for (i = 0; i < FILTER_SETTLE_SAMPLES; i++) {
+    filtered = filterCap(&filterCheck, AD7746_ZERO_COUNTS + 1);
+  }
+
+  if (filtered != (AD7746_ZERO_COUNTS + 1)) {
+    System_abort("Bad capacitance filter\n");
+  }
+
+  for (i = 0; i < MAX_SENSORS; i++) {
+    switchNew[i]     = swNewACS;
+    relayPosition[i] = PCA9536_OUT_PORT_NEW_ACS;
+  }
 
   // All led ON once HW init done
   GPIO_write(Board_LED0, Board_LED_ON);
@@ -1758,35 +5278,14 @@ int main(void) {
   GPIO_write(Board_LED2, Board_LED_ON);
   GPIO_write(Board_LED3, Board_LED_ON);
 
-  // Init Interrupt sensor 0
-  GPIO_disableInt(Board_PININ0);
-  GPIO_clearInt(Board_PININ0);
-  GPIO_setCallback(Board_PININ0, sens0cvtDoneItr);
-
-  // Init Interrupt sensor 1
-  GPIO_disableInt(Board_PININ1);
-  GPIO_clearInt(Board_PININ1);
-  GPIO_setCallback(Board_PININ1, sens1cvtDoneItr);
-
-  // Init Interrupt sensor 2
-  GPIO_disableInt(Board_PININ2);
-  GPIO_clearInt(Board_PININ2);
-  GPIO_setCallback(Board_PININ2, sens2cvtDoneItr);
-
-  // Init Interrupt sensor 3
-  GPIO_disableInt(Board_PININ3);
-  GPIO_clearInt(Board_PININ3);
-  GPIO_setCallback(Board_PININ3, sens3cvtDoneItr);
-
-  // Init Interrupt sensor 4
-  GPIO_disableInt(Board_PININ4);
-  GPIO_clearInt(Board_PININ4);
-  GPIO_setCallback(Board_PININ4, sens4cvtDoneItr);
-
-  // Init Interrupt sensor 5
-  GPIO_disableInt(Board_PININ5);
-  GPIO_clearInt(Board_PININ5);
-  GPIO_setCallback(Board_PININ5, sens5cvtDoneItr);
+  // Init the interrupt of each sensor that has one
+  for (i = 0; i < MAX_SENSORS; i++) {
+    if (sensorConfig[i].intline != SENSOR_NO_INTLINE) {
+      GPIO_disableInt(sensorConfig[i].intline);
+      GPIO_clearInt(sensorConfig[i].intline);
+      GPIO_setCallback(sensorConfig[i].intline, sensCvtDoneItr);
+    }
+  }
 
   /* Start BIOS */
   BIOS_start();
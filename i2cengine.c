@@ -0,0 +1,319 @@
+/*
+ * i2cengine.c
+ *
+ * Copyright (c) 2018, W. M. Keck Observatory
+ * All rights reserved.
+ *
+ * Authors: Sylvain Cetre & Paul Richards
+ *
+ * Note:
+ * -----
+ * Interrupt driven I2C master for the six sensor buses, see i2cengine.h.  Each interrupt moves the
+ * transaction at the head of the bus queue on by one byte; when it completes, its callback is
+ * called and the next transaction on the queue is started, still from the interrupt.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/* XDCtools Header files */
+#include <xdc/std.h>
+#include <xdc/runtime/Timestamp.h>
+
+/* BIOS Header files */
+#include <ti/sysbios/BIOS.h>
+#include <ti/sysbios/hal/Hwi.h>
+
+/* TI-RTOS Header files */
+#include <ti/drivers/i2c/I2CTiva.h>
+#include "inc/hw_types.h"
+#include "inc/hw_memmap.h"
+#include "driverlib/sysctl.h"
+#include "driverlib/i2c.h"
+
+#include "i2cengine.h"
+
+
+// The base address, interrupt and priority of each bus come from the board file
+extern const I2CTiva_HWAttrs i2cTivaHWAttrs[];
+
+
+/* Per bus state */
+typedef struct {
+
+  bool                  open;
+  uint32_t              base;
+  Hwi_Struct            hwi;
+
+  // Transaction queue, the head is the one on the wire
+  i2cEngineTransaction *head;
+  i2cEngineTransaction *tail;
+  bool                  reading;   // The head transaction is past its write bytes
+
+} i2cEngineBus;
+
+static i2cEngineBus i2cBus[I2C_ENGINE_BUSES];
+
+#ifdef I2C_BENCHMARK
+uint32_t i2cEngineIsrCycles[I2C_ENGINE_BUSES];
+#endif
+
+
+/* Function prototypes */
+static void i2cEngineHwi(UArg arg);
+static void i2cEngineStart(i2cEngineBus *b);
+static void i2cEngineStartRead(i2cEngineBus *b, i2cEngineTransaction *t);
+static void i2cEngineComplete(i2cEngineBus *b, i2cEngineStatus status);
+
+
+/*
+ *  ======== i2cEngineOpen ========
+ *  Take over a bus: set up the I2C master at 100kHz or 400kHz and hook its interrupt.  The bus
+ *  must not be open in the I2CTiva driver.
+ */
+void i2cEngineOpen(uint8_t bus, bool fast) {
+
+  i2cEngineBus *b = &i2cBus[bus];
+  Hwi_Params hwiParams;
+
+  if (b->open) {
+    i2cEngineClose(bus);
+  }
+
+  b->base    = i2cTivaHWAttrs[bus].baseAddr;
+  b->head    = NULL;
+  b->tail    = NULL;
+  b->reading = false;
+
+#ifdef I2C_BENCHMARK
+  i2cEngineIsrCycles[bus] = 0;
+#endif
+
+  Hwi_Params_init(&hwiParams);
+  hwiParams.arg      = bus;
+  hwiParams.priority = i2cTivaHWAttrs[bus].intPriority;
+  Hwi_construct(&b->hwi, i2cTivaHWAttrs[bus].intNum, i2cEngineHwi, &hwiParams, NULL);
+
+  I2CMasterInitExpClk(b->base, SysCtlClockGet(), fast);
+  I2CMasterIntClear(b->base);
+  I2CMasterIntEnable(b->base);
+
+  b->open = true;
+}
+
+
+/*
+ *  ======== i2cEngineClose ========
+ *  Release a bus.  Anything still queued is failed and its callback called.
+ */
+void i2cEngineClose(uint8_t bus) {
+
+  i2cEngineBus *b = &i2cBus[bus];
+  UInt key;
+
+  if (!b->open) {
+    return;
+  }
+
+  I2CMasterIntDisable(b->base);
+  I2CMasterDisable(b->base);
+
+  key = Hwi_disable();
+  b->open = false;
+  while (b->head != NULL) {
+    b->head->error = 0;
+    i2cEngineComplete(b, i2cesFailed);
+  }
+  Hwi_restore(key);
+
+  Hwi_destruct(&b->hwi);
+}
+
+
+/*
+ *  ======== i2cEngineSubmit ========
+ *  Queue a transaction on a bus, starting it straight away if the bus is idle.  Returns false if
+ *  the bus is not open or the transaction is empty.
+ */
+bool i2cEngineSubmit(uint8_t bus, i2cEngineTransaction *trans) {
+
+  i2cEngineBus *b = &i2cBus[bus];
+  UInt key;
+
+  if ((trans->writeCount == 0) && (trans->readCount == 0)) {
+    return false;
+  }
+
+  trans->status = i2cesQueued;
+  trans->error  = 0;
+  trans->next   = NULL;
+
+  key = Hwi_disable();
+
+  if (!b->open) {
+    Hwi_restore(key);
+    return false;
+  }
+
+  if (b->head == NULL) {
+    b->head = trans;
+    b->tail = trans;
+    i2cEngineStart(b);
+  } else {
+    b->tail->next = trans;
+    b->tail = trans;
+  }
+
+  Hwi_restore(key);
+  return true;
+}
+
+
+/*
+ *  ======== i2cEngineStart ========
+ *  Put the first byte of the head transaction on the wire.  Called with interrupts disabled, or
+ *  from the interrupt.
+ */
+static void i2cEngineStart(i2cEngineBus *b) {
+
+  i2cEngineTransaction *t = b->head;
+
+  t->status  = i2cesActive;
+  b->reading = false;
+
+  if (t->writeCount == 0) {
+    i2cEngineStartRead(b, t);
+    return;
+  }
+
+  I2CMasterSlaveAddrSet(b->base, t->slaveAddress, false);
+  I2CMasterDataPut(b->base, t->writeBuf[0]);
+  t->index = 1;
+
+  // A single byte with nothing to read back goes as START, byte, STOP; otherwise hold the bus
+  if ((t->writeCount == 1) && (t->readCount == 0)) {
+    I2CMasterControl(b->base, I2C_MASTER_CMD_SINGLE_SEND);
+  } else {
+    I2CMasterControl(b->base, I2C_MASTER_CMD_BURST_SEND_START);
+  }
+}
+
+
+/*
+ *  ======== i2cEngineStartRead ========
+ *  Start (or repeated start) the read part of a transaction.
+ */
+static void i2cEngineStartRead(i2cEngineBus *b, i2cEngineTransaction *t) {
+
+  b->reading = true;
+  t->index   = 0;
+
+  I2CMasterSlaveAddrSet(b->base, t->slaveAddress, true);
+
+  if (t->readCount == 1) {
+    I2CMasterControl(b->base, I2C_MASTER_CMD_SINGLE_RECEIVE);
+  } else {
+    I2CMasterControl(b->base, I2C_MASTER_CMD_BURST_RECEIVE_START);
+  }
+}
+
+
+/*
+ *  ======== i2cEngineComplete ========
+ *  Finish the head transaction, call its callback and start the next one.
+ */
+static void i2cEngineComplete(i2cEngineBus *b, i2cEngineStatus status) {
+
+  i2cEngineTransaction *t = b->head;
+
+  b->head = t->next;
+  if (b->head == NULL) {
+    b->tail = NULL;
+  }
+
+  t->status = status;
+  if (t->callback != NULL) {
+    t->callback(t);
+  }
+
+  if ((b->head != NULL) && b->open) {
+    i2cEngineStart(b);
+  }
+}
+
+
+/*
+ *  ======== i2cEngineHwi ========
+ *  I2C master interrupt: the last command has finished, issue the next one.
+ */
+static void i2cEngineHwi(UArg arg) {
+
+  i2cEngineBus *b = &i2cBus[arg];
+  i2cEngineTransaction *t = b->head;
+  uint32_t err;
+
+#ifdef I2C_BENCHMARK
+  uint32_t start = Timestamp_get32();
+#endif
+
+  I2CMasterIntClear(b->base);
+
+  if (t == NULL) {
+    return;
+  }
+
+  err = I2CMasterErr(b->base);
+
+  if (err != I2C_MASTER_ERR_NONE) {
+
+    // The master has already let go of the bus if it lost arbitration, otherwise release it
+    if (!(err & I2C_MASTER_ERR_ARB_LOST)) {
+      I2CMasterControl(b->base, b->reading ? I2C_MASTER_CMD_BURST_RECEIVE_ERROR_STOP :
+                                             I2C_MASTER_CMD_BURST_SEND_ERROR_STOP);
+    }
+
+    t->error = err;
+    i2cEngineComplete(b, i2cesFailed);
+
+  } else if (!b->reading) {
+
+    if (t->index < t->writeCount) {
+
+      // Next byte; the last one stops the bus unless there is a read to follow
+      I2CMasterDataPut(b->base, t->writeBuf[t->index++]);
+
+      if ((t->index == t->writeCount) && (t->readCount == 0)) {
+        I2CMasterControl(b->base, I2C_MASTER_CMD_BURST_SEND_FINISH);
+      } else {
+        I2CMasterControl(b->base, I2C_MASTER_CMD_BURST_SEND_CONT);
+      }
+
+    } else if (t->readCount > 0) {
+      i2cEngineStartRead(b, t);
+
+    } else {
+      i2cEngineComplete(b, i2cesDone);
+    }
+
+  } else {
+
+    t->readBuf[t->index++] = I2CMasterDataGet(b->base);
+
+    if (t->index < t->readCount) {
+
+      // NACK and stop on the last byte
+      if (t->index == (t->readCount - 1)) {
+        I2CMasterControl(b->base, I2C_MASTER_CMD_BURST_RECEIVE_FINISH);
+      } else {
+        I2CMasterControl(b->base, I2C_MASTER_CMD_BURST_RECEIVE_CONT);
+      }
+
+    } else {
+      i2cEngineComplete(b, i2cesDone);
+    }
+  }
+
+#ifdef I2C_BENCHMARK
+  i2cEngineIsrCycles[arg] += Timestamp_get32() - start;
+#endif
+}
@@ -0,0 +1,77 @@
+/*
+ * i2cengine.h
+ *
+ * Copyright (c) 2018, W. M. Keck Observatory
+ * All rights reserved.
+ *
+ * Authors: Sylvain Cetre & Paul Richards
+ *
+ * Note:
+ * -----
+ * Interrupt driven I2C master for the six sensor buses, driven directly through the driverlib
+ * I2CMaster* calls instead of the TI-RTOS I2CTiva driver.  Transactions are queued per bus and
+ * completed from the I2C interrupt, which calls the transaction's callback.  A bus is owned either
+ * by this engine or by I2CTiva, never both: they share the INT_I2Cn interrupt.
+ */
+
+#ifndef __I2CENGINE_H
+#define __I2CENGINE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include <xdc/std.h>
+
+#define I2C_ENGINE_BUSES          6
+
+
+/* Transaction status */
+typedef enum {
+
+  i2cesQueued                   = 0,  // Waiting on the bus queue
+  i2cesActive                   = 1,  // On the wire
+  i2cesDone                     = 2,  // Completed successfully
+  i2cesFailed                   = 3   // NACK, arbitration lost or bus error
+
+} i2cEngineStatus;
+
+
+struct i2cEngineTransaction;
+
+/* Completion callback, called from the I2C interrupt */
+typedef void (*i2cEngineCallback)(struct i2cEngineTransaction *trans);
+
+
+/* A transaction: write writeCount bytes, then read readCount bytes with a repeated start.  Either
+ * count may be zero, but not both.  The caller owns the storage, which must stay valid until the
+ * callback has been called. */
+typedef struct i2cEngineTransaction {
+
+  uint8_t                       slaveAddress;
+  const uint8_t                *writeBuf;
+  uint32_t                      writeCount;
+  uint8_t                      *readBuf;
+  uint32_t                      readCount;
+
+  i2cEngineCallback             callback;
+  UArg                          arg;
+
+  // Owned by the engine
+  volatile i2cEngineStatus      status;
+  uint32_t                      error;     // I2CMasterErr() bits on failure
+  uint32_t                      index;
+  struct i2cEngineTransaction  *next;
+
+} i2cEngineTransaction;
+
+
+void i2cEngineOpen(uint8_t bus, bool fast);
+void i2cEngineClose(uint8_t bus);
+bool i2cEngineSubmit(uint8_t bus, i2cEngineTransaction *trans);
+
+#ifdef I2C_BENCHMARK
+// CPU cycles spent in the interrupt handler of each bus since it was opened
+extern uint32_t i2cEngineIsrCycles[I2C_ENGINE_BUSES];
+#endif
+
+#endif /* __I2CENGINE_H */
@@ -0,0 +1,172 @@
+#!/usr/bin/env python3
+#
+# footprint.py
+#
+# Copyright (c) 2018, W. M. Keck Observatory
+# All rights reserved.
+#
+# Note:
+# -----
+# Post-build footprint gate.  Reads the linker map and XML link info written by the ARM linker and
+# checks memory area and output section sizes against the limits in a budget file (see
+# footprint-budget.txt).  Exits non-zero, failing the CCS build, if anything is over budget or the
+# two linker outputs disagree.
+#
+# Usage: footprint.py --budget footprint-budget.txt acsnb-sensor-tiva.map acsnb-sensor-tiva_linkInfo.xml
+
+import argparse
+import re
+import sys
+import xml.etree.ElementTree as ET
+
+# Number of input sections listed under an output section that is over budget
+TOP_CONTRIBUTORS = 8
+
+
+def parse_int(text):
+    return int(text, 0)
+
+
+def read_budget(path):
+    """Budget file: one limit per line, 'memory <name> <bytes>' or 'section <name> <bytes>'."""
+    budget = {'memory': {}, 'section': {}}
+
+    with open(path) as f:
+        for number, line in enumerate(f, 1):
+            line = line.split('#', 1)[0].strip()
+            if not line:
+                continue
+
+            fields = line.split()
+            if len(fields) != 3 or fields[0] not in budget:
+                raise ValueError('%s:%d: expected "memory|section <name> <bytes>"' % (path, number))
+
+            budget[fields[0]][fields[1]] = parse_int(fields[2])
+
+    return budget
+
+
+def read_link_info(path):
+    """Memory area usage and output section sizes from the XML link info."""
+    root = ET.parse(path).getroot()
+    memory = {}
+    sections = {}
+
+    for area in root.iter('memory_area'):
+        memory[area.findtext('name')] = {
+            'length': parse_int(area.findtext('length')),
+            'used':   parse_int(area.findtext('used_space')),
+        }
+
+    # Only the top level groups are output sections, the rest are nested inside them
+    group_list = root.find('logical_group_list')
+    if group_list is not None:
+        for group in group_list.findall('logical_group'):
+            name = group.findtext('name')
+            size = group.findtext('size')
+            if name and size is not None:
+                sections[name] = sections.get(name, 0) + parse_int(size)
+
+    return memory, sections
+
+
+def read_map(path):
+    """Memory area usage, and the input sections making up each output section, from the map."""
+    memory = {}
+    inputs = {}
+    section = None
+    in_memory = False
+    in_sections = False
+
+    area_line = re.compile(r'^\s+(\S+)\s+([0-9a-f]{8})\s+([0-9a-f]{8})\s+([0-9a-f]{8})\s+([0-9a-f]{8})\s')
+    output_line = re.compile(r'^(\.\S+|\S+)\s+\d+\s+[0-9a-f]{8}\s+([0-9a-f]{8})')
+    input_line = re.compile(r'^\s{10,}[0-9a-f]{8}\s+([0-9a-f]{8})\s+(.*\S)')
+
+    with open(path) as f:
+        for line in f:
+
+            if line.startswith('MEMORY CONFIGURATION'):
+                in_memory = True
+                continue
+            if line.startswith('SEGMENT ALLOCATION MAP'):
+                in_memory = False
+                continue
+            if line.startswith('SECTION ALLOCATION MAP'):
+                in_sections = True
+                continue
+            if in_sections and (line.startswith('MODULE SUMMARY') or line.startswith('LINKER GENERATED')):
+                break
+
+            if in_memory:
+                m = area_line.match(line)
+                if m:
+                    memory[m.group(1)] = {'length': int(m.group(3), 16), 'used': int(m.group(4), 16)}
+
+            elif in_sections:
+                m = output_line.match(line)
+                if m:
+                    section = m.group(1)
+                    inputs.setdefault(section, [])
+                    continue
+
+                m = input_line.match(line)
+                if m and section is not None and '--HOLE--' not in m.group(2):
+                    inputs[section].append((int(m.group(1), 16), m.group(2)))
+
+    return memory, inputs
+
+
+def check(kind, name, used, limit, total=None):
+    over = used > limit
+    share = '' if total is None else '  %5.1f%% of %d' % (100.0 * used / total, total)
+    print('%-4s %-7s %-12s %7d / %7d%s' % ('OVER' if over else 'ok', kind, name, used, limit, share))
+    return not over
+
+
+def main():
+    parser = argparse.ArgumentParser(description='Check the linker output against a footprint budget.')
+    parser.add_argument('--budget', required=True, help='budget file')
+    parser.add_argument('map', help='linker map (.map)')
+    parser.add_argument('linkinfo', help='XML link info (_linkInfo.xml)')
+    args = parser.parse_args()
+
+    try:
+        budget = read_budget(args.budget)
+        xml_memory, sections = read_link_info(args.linkinfo)
+        map_memory, inputs = read_map(args.map)
+    except (IOError, ValueError, ET.ParseError) as e:
+        print('footprint: %s' % e, file=sys.stderr)
+        return 2
+
+    ok = True
+
+    # The two files come from the same link, so a mismatch means one of them is stale
+    for name, area in sorted(xml_memory.items()):
+        if name in map_memory and map_memory[name]['used'] != area['used']:
+            print('footprint: %s used is %d in %s but %d in %s, rebuild' %
+                  (name, area['used'], args.linkinfo, map_memory[name]['used'], args.map), file=sys.stderr)
+            return 2
+
+    for name, limit in sorted(budget['memory'].items()):
+        if name not in xml_memory:
+            print('footprint: no memory area %s in %s' % (name, args.linkinfo), file=sys.stderr)
+            return 2
+        area = xml_memory[name]
+        ok &= check('memory', name, area['used'], limit, area['length'])
+
+    for name, limit in sorted(budget['section'].items()):
+        used = sections.get(name, 0)
+        if not check('section', name, used, limit):
+            ok = False
+            for size, what in sorted(inputs.get(name, []), reverse=True)[:TOP_CONTRIBUTORS]:
+                print('                  %7d  %s' % (size, what))
+
+    if not ok:
+        print('footprint: over budget, see %s' % args.budget, file=sys.stderr)
+        return 1
+
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
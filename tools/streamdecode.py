@@ -0,0 +1,297 @@
+#!/usr/bin/env python3
+#
+# streamdecode.py
+#
+# Copyright (c) 2018, W. M. Keck Observatory
+# All rights reserved.
+#
+# Note:
+# -----
+# Reference decoder for the delta stream frame (frame type 5, SIGNATURE1_DELTA), see the layout
+# above DELTA_FRAME_HEADER in acsnb-sensor-tiva.c.  Reads captured frames as hex, one frame per
+# line, and prints one line per sample: sensor, adCapSelect, time (ms) and raw conversion.
+#
+# --self-test runs an encoder written to match the firmware against the decoder on random sample
+# streams, with repeated and lost frames, and checks that every sample comes back intact.
+#
+# Usage: streamdecode.py [frames.txt]
+#        streamdecode.py --self-test
+
+import argparse
+import random
+import sys
+
+SIGNATURE0 = 0xA5
+SIGNATURE1_DELTA = 0x60
+
+SPI_MESSAGE_LENGTH = 5 + (6 * 19)
+MAX_SENSORS = 6
+
+DELTA_FRAME_HEADER = 10
+DELTA_KEYFRAME_SIZE = 8
+DELTA_KEYFRAME_INTERVAL = 16
+
+
+class FrameError(Exception):
+    pass
+
+
+def zigzag(value):
+    return ((~value) << 1) | 1 if value < 0 else value << 1
+
+
+def unzigzag(value):
+    return ~(value >> 1) if value & 1 else value >> 1
+
+
+def put_varint(out, value):
+    while value >= 0x80:
+        out.append((value & 0x7F) | 0x80)
+        value >>= 7
+    out.append(value)
+
+
+def get_varint(frame, pos):
+    value = 0
+    shift = 0
+    while True:
+        if pos >= len(frame) or shift > 28:
+            raise FrameError('bad varint at byte %d' % pos)
+        byte = frame[pos]
+        pos += 1
+        value |= (byte & 0x7F) << shift
+        shift += 7
+        if not byte & 0x80:
+            return value, pos
+
+
+class Decoder:
+    """Decodes a sequence of delta stream frames, keeping the state of every channel."""
+
+    def __init__(self):
+        self.seq = None
+        self.channels = {}
+        self.dropped = 0
+        self.lost = 0
+
+    def decode(self, frame):
+        """Returns the samples in a frame as (sensor, cap select, time, counts) tuples."""
+        if len(frame) < DELTA_FRAME_HEADER or frame[0] != SIGNATURE0 or frame[1] != SIGNATURE1_DELTA:
+            raise FrameError('not a delta stream frame')
+
+        seq, count, dropped = frame[5], frame[6], frame[7]
+        size = (frame[8] << 8) | frame[9]
+        if DELTA_FRAME_HEADER + size > len(frame):
+            raise FrameError('record bytes run past the end of the frame')
+
+        # A repeated frame was already decoded; after a lost one every channel waits for a keyframe
+        if seq == self.seq:
+            return []
+        if self.seq is not None and seq != ((self.seq + 1) & 0xFF):
+            self.lost += 1
+            self.channels.clear()
+        self.seq = seq
+        self.dropped += dropped
+
+        samples = []
+        pos = DELTA_FRAME_HEADER
+        end = DELTA_FRAME_HEADER + size
+
+        for _ in range(count):
+            if pos >= end:
+                raise FrameError('fewer records than the count')
+
+            tag = frame[pos]
+            pos += 1
+            sensor = (tag >> 4) & 0x07
+            channel = tag & 0x03
+
+            if tag & 0x80:
+                if pos + DELTA_KEYFRAME_SIZE - 1 > end:
+                    raise FrameError('short keyframe')
+                time = int.from_bytes(frame[pos:pos + 4], 'big')
+                counts = int.from_bytes(frame[pos + 4:pos + 7], 'big')
+                pos += DELTA_KEYFRAME_SIZE - 1
+            else:
+                dtime, pos = get_varint(frame, pos)
+                dcounts, pos = get_varint(frame, pos)
+                if (sensor, channel) not in self.channels:
+                    # Not synced since the last gap, there is nothing to add the delta to
+                    continue
+                time, counts = self.channels[(sensor, channel)]
+                time = (time + dtime) & 0xFFFFFFFF
+                counts = counts + unzigzag(dcounts)
+                if not 0 <= counts <= 0xFFFFFF:
+                    raise FrameError('delta takes the conversion out of range')
+
+            self.channels[(sensor, channel)] = (time, counts)
+            samples.append((sensor, 0x80 | (channel << 5), time, counts))
+
+        if pos != end:
+            raise FrameError('record bytes do not match the count')
+
+        return samples
+
+
+class Encoder:
+    """The firmware's composeDeltaFrame, for the self test."""
+
+    def __init__(self):
+        self.seq = 0
+        self.first = 0
+        self.channels = {}
+
+    def record(self, out, sensor, cap, time, counts):
+        channel = (cap >> 5) & 0x03
+        key = (sensor, channel)
+        synced, since_key, last_time, last_counts = self.channels.get(key, (False, 0, 0, 0))
+
+        dtime = (time - last_time) & 0xFFFFFFFF
+        dcounts = zigzag(counts - last_counts)
+        delta = bytearray()
+        put_varint(delta, dtime)
+        put_varint(delta, dcounts)
+
+        if synced and since_key < DELTA_KEYFRAME_INTERVAL and 1 + len(delta) < DELTA_KEYFRAME_SIZE:
+            out.append((sensor << 4) | channel)
+            out += delta
+            self.channels[key] = (True, since_key + 1, time, counts)
+        else:
+            out.append(0x80 | (sensor << 4) | channel)
+            out += time.to_bytes(4, 'big') + counts.to_bytes(3, 'big')
+            self.channels[key] = (True, 0, time, counts)
+
+    def compose(self, streams, dropped=0):
+        """Drain the per-sensor sample lists into one frame, round robin as the firmware does."""
+        records = bytearray()
+        count = 0
+        found = True
+
+        while DELTA_FRAME_HEADER + len(records) <= SPI_MESSAGE_LENGTH - DELTA_KEYFRAME_SIZE and found:
+            found = False
+            for i in range(MAX_SENSORS):
+                if DELTA_FRAME_HEADER + len(records) > SPI_MESSAGE_LENGTH - DELTA_KEYFRAME_SIZE:
+                    break
+                sensor = (self.first + i) % MAX_SENSORS
+                if not streams[sensor]:
+                    continue
+                cap, time, counts = streams[sensor].pop(0)
+                self.record(records, sensor, cap, time, counts)
+                count += 1
+                found = True
+
+        self.first = (self.first + 1) % MAX_SENSORS
+
+        frame = bytearray(SPI_MESSAGE_LENGTH)
+        frame[0:10] = bytes([SIGNATURE0, SIGNATURE1_DELTA, 0, 0, 0, self.seq, count, min(dropped, 0xFF),
+                             len(records) >> 8, len(records) & 0xFF])
+        frame[DELTA_FRAME_HEADER:DELTA_FRAME_HEADER + len(records)] = records
+        self.seq = (self.seq + 1) & 0xFF
+        return bytes(frame)
+
+
+def random_streams(rng, samples):
+    """Random walks per sensor, cycling through the capacitors as adGetAllCaps does."""
+    caps = [0xE0, 0x80, 0xC0]
+    streams = [[] for _ in range(MAX_SENSORS)]
+    for sensor in range(MAX_SENSORS):
+        time = rng.randrange(1 << 32)
+        counts = {cap: rng.randrange(1 << 24) for cap in caps}
+        all_caps = rng.random() < 0.5
+        for n in range(samples):
+            cap = caps[n % 3] if all_caps else caps[0]
+            # Mostly steady conversions with a few low bits of noise, now and then a gap or a jump
+            if rng.random() < 0.95:
+                time = (time + rng.choice([38, 39, 109, 110])) & 0xFFFFFFFF
+                step = rng.randrange(-40, 41)
+            else:
+                time = (time + rng.randrange(1 << 20)) & 0xFFFFFFFF
+                step = rng.randrange(-(1 << 23), 1 << 23)
+            counts[cap] = min(max(counts[cap] + step, 0), 0xFFFFFF)
+            streams[sensor].append((cap, time, counts[cap]))
+    return streams
+
+
+def self_test(seed, runs):
+    rng = random.Random(seed)
+    sent = 0
+    coded = 0
+
+    for _ in range(runs):
+        streams = random_streams(rng, rng.randrange(1, 400))
+        expected = [(s, c, t, v) for s in range(MAX_SENSORS) for (c, t, v) in streams[s]]
+        sent += len(expected)
+
+        encoder = Encoder()
+        decoder = Decoder()
+        decoded = []
+        lossless = True
+
+        while any(streams):
+            frame = encoder.compose(streams)
+            coded += (frame[8] << 8) | frame[9]
+
+            chance = rng.random()
+            if chance < 0.05:
+                lossless = False
+                continue
+            decoded += decoder.decode(frame)
+            if chance < 0.15:
+                if decoder.decode(frame):
+                    raise AssertionError('repeated frame decoded twice')
+
+        # Every decoded sample must be one that was sent, in order per channel; without lost
+        # frames all of them must come back
+        for sensor in range(MAX_SENSORS):
+            got = [d for d in decoded if d[0] == sensor]
+            want = [e for e in expected if e[0] == sensor]
+            if lossless:
+                if got != want:
+                    raise AssertionError('sensor %d: samples differ' % sensor)
+            else:
+                it = iter(want)
+                if not all(any(g == w for w in it) for g in got):
+                    raise AssertionError('sensor %d: sample decoded wrong after a lost frame' % sensor)
+
+    print('%d samples, %.2f bytes per sample (%d for the sample stream frame)' %
+          (sent, coded / sent, 9))
+
+
+def main():
+    parser = argparse.ArgumentParser(description='Decode delta stream frames.')
+    parser.add_argument('frames', nargs='?', help='captured frames as hex, one per line (default stdin)')
+    parser.add_argument('--self-test', action='store_true', help='round trip random streams through an encoder')
+    parser.add_argument('--seed', type=int, default=1)
+    parser.add_argument('--runs', type=int, default=200)
+    args = parser.parse_args()
+
+    try:
+        if args.self_test:
+            self_test(args.seed, args.runs)
+            return 0
+
+        decoder = Decoder()
+        with (open(args.frames) if args.frames else sys.stdin) as f:
+            for number, line in enumerate(f, 1):
+                line = line.strip()
+                if not line:
+                    continue
+                try:
+                    for sample in decoder.decode(bytes.fromhex(line)):
+                        print('%u 0x%02X %u %u' % sample)
+                except (ValueError, FrameError) as e:
+                    print('frame %d: %s' % (number, e), file=sys.stderr)
+
+        if decoder.lost or decoder.dropped:
+            print('%d frames lost, %d samples dropped by the device' % (decoder.lost, decoder.dropped),
+                  file=sys.stderr)
+
+    except (AssertionError, OSError) as e:
+        print('streamdecode: %s' % e, file=sys.stderr)
+        return 2
+
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())